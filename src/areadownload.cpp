@@ -0,0 +1,276 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <cassert>
+#include <QDebug>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QStringBuilder>
+#include <QtAlgorithms>
+#include "areadownload.h"
+
+// Time to wait for indices to arrive before planning again, in ms
+static const int planRetryTimeout = 500;
+
+// Tiles of a bundle file closer than this are fetched in one range, bytes
+static const uint32_t maxRangeGap = 64 * 1024;
+
+// Longest range to fetch with one request, in bytes. Each range in flight is
+// held in memory until its tiles are written to the disk cache.
+static const uint32_t maxRangeLength = 4 * 1024 * 1024;
+
+// Number of ranges to fetch at once
+static const int maxRangesInFlight = 2;
+
+AreaDownload::AreaDownload(Map *m, Cache::Cache &c, QNetworkAccessManager &mgr,
+                           int layer, QRect area, int minLevel, int maxLevel,
+                           QObject *parent)
+  : QObject(parent), map(m), cache(c), manager(mgr), fLayer(layer), 
+    fArea(area), fMinLevel(minLevel), fMaxLevel(maxLevel), state(Idle), 
+    nextRange(0), fNumTiles(0), fNumCachedTiles(0), fNumFailedTiles(0), 
+    fTotalBytes(0), fDoneBytes(0)
+{
+  retryTimer.setSingleShot(true);
+  connect(&retryTimer, SIGNAL(timeout()), this, SLOT(tryPlan()));
+  connect(&cache, SIGNAL(tileLoaded()), this, SLOT(tileLoaded()));
+}
+
+AreaDownload::~AreaDownload()
+{
+  cancel();
+}
+
+void AreaDownload::plan()
+{
+  state = Planning;
+  tryPlan();
+}
+
+bool AreaDownload::plannedTileLessThan(const PlannedTile &a, 
+                                       const PlannedTile &b)
+{
+  return (a.qidx < b.qidx) || (a.qidx == b.qidx && a.offset < b.offset);
+}
+
+void AreaDownload::tileLoaded()
+{
+  if (state == Planning && !retryTimer.isActive()) {
+    retryTimer.start(planRetryTimeout);
+  }
+}
+
+void AreaDownload::tryPlan()
+{
+  if (state != Planning) {
+    return;
+  }
+
+  // Which tiles are cached can't be known until the disk index is read
+  if (!cache.loadDiskIndexNow()) {
+    retryTimer.start(planRetryTimeout);
+    return;
+  }
+
+  // Locating every tile again on each attempt is cheap once the indices are
+  // in memory, and requests all the missing indices at once
+  located.clear();
+  fNumCachedTiles = 0;
+  bool complete = true;
+  for (int level = fMinLevel; level <= fMaxLevel; level++) {
+    QList<PlannedTile> found;
+    if (!cache.findTileRanges(fLayer, level, map->mapRectToTileRect(fArea, level),
+                              found)) {
+      complete = false;
+    }
+    foreach (const PlannedTile &p, found) {
+      if (cache.isTileOnDisk(p.tile)) {
+        fNumCachedTiles++;
+      } else if (p.len > 0) {  // Empty tiles lie outside the map data
+        located << p;
+      }
+    }
+  }
+  if (!complete) {
+    retryTimer.start(planRetryTimeout);
+    return;
+  }
+
+  // Group the tiles into ranges of each bundle file
+  qSort(located.begin(), located.end(), plannedTileLessThan);
+  ranges.clear();
+  fTotalBytes = 0;
+  foreach (const PlannedTile &p, located) {
+    fTotalBytes += p.len;
+    if (!ranges.isEmpty()) {
+      PlannedRange &r = ranges.last();
+      uint32_t end = r.offset + r.length;
+      if (r.qidx == p.qidx && p.offset >= end && p.offset - end <= maxRangeGap &&
+          p.offset + p.len - r.offset <= maxRangeLength) {
+        r.length = p.offset + p.len - r.offset;
+        r.tiles << p;
+        continue;
+      }
+    }
+    PlannedRange r;
+    r.qidx = p.qidx;
+    r.offset = p.offset;
+    r.length = p.len;
+    r.tiles << p;
+    ranges << r;
+  }
+  fNumTiles = located.size();
+  located.clear();
+
+  state = Planned;
+  emit(planned(fNumTiles, fTotalBytes));
+}
+
+void AreaDownload::start()
+{
+  assert(state == Planned);
+  state = Downloading;
+  nextRange = 0;
+  fDoneBytes = 0;
+  fNumFailedTiles = 0;
+  startRanges();
+}
+
+void AreaDownload::cancel()
+{
+  state = Done;
+  retryTimer.stop();
+  QList<QNetworkReply *> replies = fetches.keys();
+  foreach (QNetworkReply *reply, replies) {
+    reply->disconnect(this);
+    reply->abort();
+    reply->deleteLater();
+    delete fetches.take(reply);
+  }
+}
+
+void AreaDownload::startRanges()
+{
+  while (state == Downloading && fetches.size() < maxRangesInFlight &&
+         nextRange < ranges.size()) {
+    const PlannedRange &r = ranges[nextRange];
+
+    QString url = map->baseUrl().toString() % "/" % 
+      map->indexFile(fLayer, r.qidx) % ".dat";
+    QNetworkRequest req;
+    req.setUrl(QUrl(url));
+    req.setAttribute(QNetworkRequest::CacheSaveControlAttribute, false);
+    QString rangeHdr = "bytes=" % QString::number(uint(r.offset)) % "-" %
+      QString::number(uint(r.offset + r.length - 1));
+    req.setRawHeader(QByteArray("Range"), rangeHdr.toLatin1());
+
+    Fetch *f = new Fetch;
+    f->range = nextRange++;
+    f->started = false;
+    f->ok = false;
+    f->nextTile = 0;
+
+    QNetworkReply *reply = manager.get(req);
+    fetches.insert(reply, f);
+    if (reply->error()) {
+      finish(reply);
+    } else {
+      connect(reply, SIGNAL(readyRead()), this, SLOT(dataReceived()));
+      connect(reply, SIGNAL(finished()), this, SLOT(rangeFinished()));
+    }
+  }
+
+  if (state == Downloading && fetches.isEmpty() && nextRange >= ranges.size()) {
+    state = Done;
+    ranges.clear();
+    emit(finished(fNumFailedTiles == 0));
+  }
+}
+
+void AreaDownload::dataReceived()
+{
+  receive(qobject_cast<QNetworkReply *>(sender()));
+}
+
+void AreaDownload::rangeFinished()
+{
+  finish(qobject_cast<QNetworkReply *>(sender()));
+}
+
+// Write each tile to the disk cache as soon as all of its bytes arrive
+void AreaDownload::receive(QNetworkReply *reply)
+{
+  Fetch *f = fetches.value(reply);
+  if (!f) {
+    return;
+  }
+  if (!f->started) {
+    f->started = true;
+    int status = 
+      reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    f->ok = f->parser.start(status, reply->rawHeader("Content-Type"),
+                            reply->rawHeader("Content-Range"), 
+                            ranges[f->range].offset);
+  }
+  QByteArray data = reply->readAll();
+  if (!f->ok) {
+    return;
+  }
+  f->ok = f->parser.addData(data);
+
+  const PlannedRange &r = ranges[f->range];
+  while (f->ok && f->nextTile < r.tiles.size()) {
+    const PlannedTile &p = r.tiles[f->nextTile];
+    QByteArray tileData;
+    if (!f->parser.find(p.offset, p.len, tileData)) {
+      break;
+    }
+    if (cache.storeTile(p.tile, tileData)) {
+      fDoneBytes += p.len;
+    } else {
+      // Fetched again if the download is resumed
+      fNumFailedTiles++;
+    }
+    f->nextTile++;
+  }
+  emit(progress(fDoneBytes, fTotalBytes));
+}
+
+void AreaDownload::finish(QNetworkReply *reply)
+{
+  Fetch *f = fetches.value(reply);
+  if (!f) {
+    return;
+  }
+  if (reply->error() == QNetworkReply::NoError) {
+    receive(reply);
+  } else {
+    qWarning() << "Area download failed: " << reply->errorString();
+  }
+
+  // Whatever didn't arrive will be fetched if the download is resumed
+  fNumFailedTiles += ranges[f->range].tiles.size() - f->nextTile;
+
+  // Free the tile list of a completed range
+  ranges[f->range].tiles.clear();
+  fetches.remove(reply);
+  delete f;
+  reply->deleteLater();
+  startRanges();
+}
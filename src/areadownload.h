@@ -0,0 +1,122 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef AREADOWNLOAD_H
+#define AREADOWNLOAD_H 1
+
+#include <stdint.h>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QRect>
+#include <QTimer>
+#include "byteranges.h"
+#include "map.h"
+#include "tilecache.h"
+
+class QNetworkAccessManager;
+class QNetworkReply;
+
+// Downloads every tile of a map area over a range of levels into the disk 
+// cache, for use without a network connection. Downloading happens in two
+// steps: plan() loads the indices needed to locate the tiles and emits
+// planned() with the size of the download; start() then fetches the tiles
+// in large ranges of each bundle file. Tiles already in the disk cache are
+// skipped, so an interrupted download is resumed by planning it again.
+class AreaDownload : public QObject {
+  Q_OBJECT
+ public:
+  AreaDownload(Map *m, Cache::Cache &c, QNetworkAccessManager &mgr, int layer,
+               QRect area, int minLevel, int maxLevel, QObject *parent = 0);
+  ~AreaDownload();
+
+  int layer() const { return fLayer; }
+  QRect area() const { return fArea; }
+  int minLevel() const { return fMinLevel; }
+  int maxLevel() const { return fMaxLevel; }
+
+  void plan();
+  void start();
+  void cancel();
+
+  int numTiles() const { return fNumTiles; }
+  int numCachedTiles() const { return fNumCachedTiles; }
+  int numFailedTiles() const { return fNumFailedTiles; }
+  qint64 totalBytes() const { return fTotalBytes; }
+  qint64 doneBytes() const { return fDoneBytes; }
+
+ signals:
+  // Tiles to download and their total size, excluding cached tiles
+  void planned(int tiles, qint64 bytes);
+  void progress(qint64 doneBytes, qint64 totalBytes);
+  // ok is false if any tiles could not be downloaded
+  void finished(bool ok);
+
+ private slots:
+  void tryPlan();
+  void tileLoaded();
+  void dataReceived();
+  void rangeFinished();
+
+ private:
+  enum State { Idle, Planning, Planned, Downloading, Done };
+
+  typedef Cache::TileRange PlannedTile;
+  static bool plannedTileLessThan(const PlannedTile &a, const PlannedTile &b);
+
+  // A contiguous range of a bundle file, fetched with one request
+  struct PlannedRange {
+    qkey qidx;
+    uint32_t offset, length;
+    QList<PlannedTile> tiles;
+  };
+
+  struct Fetch {
+    int range;
+    ByteRangeParser parser;
+    bool started, ok;
+    int nextTile;  // First tile of the range not yet stored
+  };
+
+  Map *map;
+  Cache::Cache &cache;
+  QNetworkAccessManager &manager;
+
+  int fLayer;
+  QRect fArea;
+  int fMinLevel, fMaxLevel;
+
+  State state;
+  QTimer retryTimer;
+
+  QList<PlannedTile> located;
+  QList<PlannedRange> ranges;
+  int nextRange;
+
+  QHash<QNetworkReply *, Fetch *> fetches;
+
+  int fNumTiles, fNumCachedTiles, fNumFailedTiles;
+  qint64 fTotalBytes, fDoneBytes;
+
+  void startRanges();
+  void receive(QNetworkReply *reply);
+  void finish(QNetworkReply *reply);
+};
+
+#endif
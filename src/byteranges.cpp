@@ -0,0 +1,177 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <QRegExp>
+#include "byteranges.h"
+
+ByteRangeParser::ByteRangeParser()
+  : multipart(false), state(Done), remaining(0)
+{
+}
+
+bool ByteRangeParser::parseContentRange(const QByteArray &value, 
+                                        uint32_t &start, uint32_t &end)
+{
+  // e.g. "bytes 500-999/8000" or "bytes 500-999/*"
+  QRegExp re("^\\s*bytes\\s+(\\d+)-(\\d+)/(\\d+|\\*)\\s*$", Qt::CaseInsensitive);
+  if (!re.exactMatch(QString::fromLatin1(value))) {
+    return false;
+  }
+  bool okStart, okEnd;
+  start = re.cap(1).toUInt(&okStart);
+  end = re.cap(2).toUInt(&okEnd);
+  return okStart && okEnd && start <= end;
+}
+
+bool ByteRangeParser::start(int status, const QByteArray &contentType,
+                            const QByteArray &contentRange, uint32_t requestStart)
+{
+  fRanges.clear();
+  buffer.clear();
+  remaining = 0;
+
+  if (status != 0 && status != 200 && status != 206) {
+    return false;  // An error page, not the resource
+  } else if (status != 206) {
+    // The server sent the whole resource
+    multipart = false;
+    fRanges << ByteRange(0);
+    return true;
+  }
+
+  QRegExp re("^\\s*multipart/byteranges\\s*;.*boundary\\s*=\\s*\"?([^\";]+)\"?", 
+             Qt::CaseInsensitive);
+  if (re.indexIn(QString::fromLatin1(contentType)) >= 0) {
+    multipart = true;
+    state = Boundary;
+    delimiter = "--" + re.cap(1).trimmed().toLatin1();
+    return true;
+  }
+
+  multipart = false;
+  uint32_t s = requestStart, e;
+  if (!contentRange.isEmpty() && !parseContentRange(contentRange, s, e)) {
+    return false;
+  }
+  fRanges << ByteRange(s);
+  return true;
+}
+
+bool ByteRangeParser::addData(const QByteArray &data)
+{
+  if (!multipart) {
+    fRanges.last().data.append(data);
+    return true;
+  }
+
+  buffer.append(data);
+  forever {
+    switch (state) {
+    case Boundary: {
+      int i = buffer.indexOf(delimiter);
+      if (i < 0) {
+        // Keep enough to match a delimiter split across pieces
+        buffer = buffer.right(delimiter.size() - 1);
+        return true;
+      }
+      buffer.remove(0, i + delimiter.size());
+      state = AfterBoundary;
+      break;
+    }
+
+    case AfterBoundary:
+      if (buffer.size() < 2) {
+        return true;
+      }
+      if (buffer.startsWith("--")) {
+        buffer.clear();
+        state = Done;
+        return true;
+      }
+      state = Headers;
+      break;
+
+    case Headers: {
+      int i = buffer.indexOf("\r\n\r\n");
+      if (i < 0) {
+        return true;
+      }
+      QList<QByteArray> lines = buffer.left(i).split('\n');
+      buffer.remove(0, i + 4);
+
+      bool found = false;
+      uint32_t s = 0, e = 0;
+      foreach (const QByteArray &line, lines) {
+        int colon = line.indexOf(':');
+        if (colon >= 0 && 
+            line.left(colon).trimmed().toLower() == "content-range") {
+          found = parseContentRange(line.mid(colon + 1), s, e);
+        }
+      }
+      if (!found) {
+        return false;
+      }
+      fRanges << ByteRange(s);
+      remaining = e - s + 1;
+      state = Body;
+      break;
+    }
+
+    case Body: {
+      int n = int(qMin(uint32_t(buffer.size()), remaining));
+      fRanges.last().data.append(buffer.constData(), n);
+      buffer.remove(0, n);
+      remaining -= n;
+      if (remaining > 0) {
+        return true;
+      }
+      state = Boundary;
+      break;
+    }
+
+    case Done:
+      return true;
+    }
+  }
+}
+
+bool ByteRangeParser::finish() const
+{
+  return !multipart || state == Done;
+}
+
+bool ByteRangeParser::find(uint32_t pos, uint32_t len, QByteArray &out) const
+{
+  foreach (const ByteRange &r, fRanges) {
+    uint32_t size = r.data.size();
+    if (pos < r.start || pos >= r.start + size) {
+      continue;
+    }
+    uint32_t off = pos - r.start;
+    if (len == 0) {
+      len = size - off;
+    }
+    if (off + len > size) {
+      return false;
+    }
+    out = QByteArray(r.data.constData() + off, len);
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,84 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef BYTERANGES_H
+#define BYTERANGES_H 1
+
+#include <stdint.h>
+#include <QByteArray>
+#include <QList>
+
+// A contiguous piece of a resource received in reply to a Range request
+struct ByteRange {
+  ByteRange(uint32_t s = 0) : start(s) { }
+  uint32_t start;
+  QByteArray data;
+};
+
+// Splits the body of an HTTP reply to a Range request into the byte ranges it
+// contains. Handles single range (206) replies, multipart/byteranges replies 
+// and servers that ignore the Range header and send the whole resource.
+// The body may be fed in pieces as it arrives.
+class ByteRangeParser {
+ public:
+  ByteRangeParser();
+
+  // Prepare to parse a reply given its headers. status is the HTTP status 
+  // code, or 0 for non-HTTP replies; requestStart is the first byte requested.
+  // Returns false if the headers cannot be understood or the status is not
+  // a success.
+  bool start(int status, const QByteArray &contentType, 
+             const QByteArray &contentRange, uint32_t requestStart);
+
+  // Parse more of the body. Returns false if the body is malformed.
+  bool addData(const QByteArray &data);
+
+  // Returns true if the body was complete.
+  bool finish() const;
+
+  // Byte ranges received so far. The last range may be incomplete until the
+  // body is finished.
+  const QList<ByteRange> &ranges() const { return fRanges; }
+
+  // Copy the bytes [pos, pos + len) out of the ranges received. A zero len
+  // means everything from pos to the end of its range. Returns false if the
+  // bytes were not all received.
+  bool find(uint32_t pos, uint32_t len, QByteArray &out) const;
+
+  static bool parseContentRange(const QByteArray &value, uint32_t &start, 
+                                uint32_t &end);
+
+ private:
+  enum State {
+    Boundary,       // Looking for the next boundary delimiter
+    AfterBoundary,  // Just after a delimiter; is it the final one?
+    Headers,        // Reading the headers of a part
+    Body,           // Reading the body of a part
+    Done
+  };
+
+  bool multipart;
+  State state;
+  QByteArray delimiter;
+  QByteArray buffer;
+  uint32_t remaining; // Bytes left in the current part
+  QList<ByteRange> fRanges;
+};
+
+#endif
@@ -0,0 +1,300 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <climits>
+#include <cstring>
+#include <QDir>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QStringBuilder>
+#include <QtEndian>
+#ifndef Q_OS_WIN
+#include <unistd.h>
+#endif
+#include "localsource.h"
+
+// Most bundle files to keep open and mapped at once
+static const int maxOpenFiles = 64;
+
+static const int archiveVersion = 1;
+static const int archiveHeaderSize = 32;
+static const int archiveEntrySize = 24;
+
+MappedFile::MappedFile()
+  : data(NULL), size(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  if (data) {
+    file.unmap(data);
+  }
+}
+
+bool MappedFile::open(const QString &path, QString &error)
+{
+  file.setFileName(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    error = file.fileName() % ": " % file.errorString();
+    return false;
+  }
+  size = file.size();
+  data = size > 0 ? file.map(0, size) : NULL;
+  return true;
+}
+
+bool MappedFile::readAt(qint64 pos, char *buf, qint64 len)
+{
+  if (pos < 0 || len < 0 || pos > size || len > size - pos) {
+    return false;
+  }
+  if (data) {
+    memcpy(buf, data + pos, len);
+    return true;
+  }
+
+#ifndef Q_OS_WIN
+  qint64 n = pread(file.handle(), buf, len, off_t(pos));
+#else
+  qint64 n = -1;
+  {
+    QMutexLocker lock(&readMutex);
+    if (file.seek(pos)) {
+      n = file.read(buf, len);
+    }
+  }
+#endif
+  return n == len;
+}
+
+// Find the length of a range of a file of the given size, resolving a zero
+// len. Returns false if the range is empty or outside the file.
+static bool resolveRange(qint64 size, uint32_t offset, uint32_t &len)
+{
+  if (len == 0 && qint64(offset) <= size) {
+    len = uint32_t(size - offset);
+  }
+  return len > 0 && qint64(offset) + len <= size;
+}
+
+static QString rangeError(const QString &name, uint32_t offset, uint32_t len)
+{
+  return QString("%1: range %2+%3 is outside the file").arg(name).arg(offset)
+    .arg(len);
+}
+
+
+bool LocalMapSource::isLocalUrl(const QUrl &url)
+{
+  return url.scheme() == "file";
+}
+
+LocalMapSource *LocalMapSource::open(const QUrl &url, QString &error)
+{
+  QString path = url.toLocalFile();
+  if (!QFileInfo(path).isFile()) {
+    return new BundleDirectory(path);
+  }
+  MapArchive *archive = new MapArchive();
+  if (!archive->open(path, error)) {
+    delete archive;
+    return NULL;
+  }
+  return archive;
+}
+
+
+BundleDirectory::BundleDirectory(const QString &r)
+  : root(r)
+{
+}
+
+BundleDirectory::MappedFilePtr BundleDirectory::openFile(const QString &name, 
+                                                         QString &error)
+{
+  QMutexLocker lock(&filesMutex);
+  MappedFilePtr f = files.value(name);
+  if (f) {
+    fileOrder.removeOne(name);
+    fileOrder.append(name);
+    return f;
+  }
+
+  f = MappedFilePtr(new MappedFile);
+  if (!f->open(QDir(root).filePath(name), error)) {
+    return MappedFilePtr();
+  }
+
+  if (fileOrder.size() >= maxOpenFiles) {
+    files.remove(fileOrder.takeFirst());
+  }
+  files.insert(name, f);
+  fileOrder.append(name);
+  return f;
+}
+
+bool BundleDirectory::read(const QString &name, uint32_t offset, uint32_t len,
+                           QByteArray &data, QString &error)
+{
+  MappedFilePtr f = openFile(name, error);
+  if (!f) {
+    return false;
+  }
+  if (!resolveRange(f->size, offset, len)) {
+    error = rangeError(f->file.fileName(), offset, len);
+    return false;
+  }
+
+  // Copied, since the file may be unmapped once evicted
+  data.resize(len);
+  if (!f->readAt(offset, data.data(), len)) {
+    error = f->file.fileName() % ": read failed";
+    data.clear();
+    return false;
+  }
+  return true;
+}
+
+
+// 64-bit FNV-1a hash of an archived file name
+static quint64 archiveHash(const QByteArray &name)
+{
+  quint64 h = Q_UINT64_C(0xcbf29ce484222325);
+  for (int i = 0; i < name.size(); i++) {
+    h = (h ^ uchar(name[i])) * Q_UINT64_C(0x100000001b3);
+  }
+  return h;
+}
+
+MapArchive::MapArchive()
+  : count(0), directory(NULL), names(NULL), namesSize(0)
+{
+}
+
+bool MapArchive::open(const QString &path, QString &error)
+{
+  uchar header[archiveHeaderSize];
+  if (!file.open(path, error)) {
+    return false;
+  }
+  if (!file.readAt(0, (char *)header, archiveHeaderSize) ||
+      memcmp(header, "ZTMA", 4) != 0) {
+    error = path % ": not a map archive";
+    return false;
+  }
+  if (qFromLittleEndian<quint32>(header + 4) != archiveVersion) {
+    error = path % ": unsupported map archive version";
+    return false;
+  }
+  quint32 n = qFromLittleEndian<quint32>(header + 8);
+  namesSize = qFromLittleEndian<quint32>(header + 12);
+  quint64 directoryPos = qFromLittleEndian<quint64>(header + 16);
+  quint64 namesPos = qFromLittleEndian<quint64>(header + 24);
+  quint64 directorySize = quint64(n) * archiveEntrySize;
+  quint64 fileSize = file.size;
+  // Positions come from the file, so compare without adding to them
+  if (n > quint32(INT_MAX / archiveEntrySize) || 
+      directoryPos > fileSize || directorySize > fileSize - directoryPos ||
+      namesPos > fileSize || namesSize > fileSize - namesPos) {
+    error = path % ": map archive is truncated";
+    return false;
+  }
+  count = n;
+
+  if (file.data) {
+    directory = file.data + directoryPos;
+    names = (const char *)file.data + namesPos;
+  } else {
+    // Too large to map, perhaps, so read just the directory
+    directoryCopy.resize(directorySize);
+    namesCopy.resize(namesSize);
+    if (!file.readAt(directoryPos, directoryCopy.data(), directorySize) ||
+        !file.readAt(namesPos, namesCopy.data(), namesSize)) {
+      error = path % ": error reading map archive directory";
+      return false;
+    }
+    directory = (const uchar *)directoryCopy.constData();
+    names = namesCopy.constData();
+  }
+  return true;
+}
+
+bool MapArchive::find(const QString &name, quint64 &offset, uint32_t &len) const
+{
+  QByteArray key = name.toUtf8();
+  quint64 h = archiveHash(key);
+
+  // Find the first entry with the hash
+  int lo = 0, hi = count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (qFromLittleEndian<quint64>(directory + mid * archiveEntrySize) < h) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (; lo < count; lo++) {
+    const uchar *entry = directory + lo * archiveEntrySize;
+    if (qFromLittleEndian<quint64>(entry) != h) {
+      break;
+    }
+    quint32 namePos = qFromLittleEndian<quint32>(entry + 20);
+    if (namePos < namesSize && namesSize - namePos > quint32(key.size()) &&
+        memcmp(names + namePos, key.constData(), key.size()) == 0 &&
+        names[namePos + key.size()] == '\0') {
+      offset = qFromLittleEndian<quint64>(entry + 8);
+      len = qFromLittleEndian<quint32>(entry + 16);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MapArchive::read(const QString &name, uint32_t offset, uint32_t len,
+                      QByteArray &data, QString &error)
+{
+  quint64 pos;
+  uint32_t fileLen;
+  if (!find(name, pos, fileLen)) {
+    error = name % ": not in map archive " % file.file.fileName();
+    return false;
+  }
+  quint64 fileSize = file.size;
+  if (!resolveRange(fileLen, offset, len) || 
+      pos > fileSize || quint64(offset) + len > fileSize - pos) {
+    error = rangeError(name, offset, len);
+    return false;
+  }
+  pos += offset;
+
+  if (file.data) {
+    data = QByteArray::fromRawData((const char *)file.data + pos, len);
+    return true;
+  }
+  data.resize(len);
+  if (!file.readAt(pos, data.data(), len)) {
+    error = name % ": error reading map archive";
+    data.clear();
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,136 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef LOCALSOURCE_H
+#define LOCALSOURCE_H 1
+
+#include <stdint.h>
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+#include <QUrl>
+
+// A file that is memory mapped if possible, and read with pread otherwise
+struct MappedFile {
+  MappedFile();
+  ~MappedFile();
+
+  bool open(const QString &path, QString &error);
+
+  // Copy len bytes at pos into buf. Returns false on a short read.
+  bool readAt(qint64 pos, char *buf, qint64 len);
+
+  QFile file;
+  uchar *data;     // The mapped file, or NULL if it could not be mapped
+  qint64 size;
+  QMutex readMutex; // Serializes seeks where pread is not available
+};
+
+// Reads map bundle files (.idxz and .dat) from the local file system, such
+// as a copy of the map on a USB stick, for maps whose base URL is a file:
+// URL. Safe to use from several threads at once.
+class LocalMapSource {
+ public:
+  virtual ~LocalMapSource() { }
+
+  // Can the map at url be read with a LocalMapSource?
+  static bool isLocalUrl(const QUrl &url);
+
+  // Open the map at a local url: a map archive if the url names a file, or
+  // else a directory of bundle files. Returns NULL, with a message in error,
+  // if an archive cannot be opened.
+  static LocalMapSource *open(const QUrl &url, QString &error);
+
+  // Read len bytes at offset of a bundle file, named relative to the map's
+  // base URL. A zero len means everything from offset to the end of the 
+  // file. Returns false, with a message in error, if the file cannot be read
+  // or the range is outside it. The data may refer to memory owned by the
+  // source, so the source must outlive it.
+  virtual bool read(const QString &name, uint32_t offset, uint32_t len, 
+                    QByteArray &data, QString &error) = 0;
+};
+
+// A directory of bundle files. A file is memory mapped when first read and
+// stays mapped while it is among the most recently used.
+class BundleDirectory : public LocalMapSource {
+ public:
+  BundleDirectory(const QString &root);
+
+  virtual bool read(const QString &name, uint32_t offset, uint32_t len, 
+                    QByteArray &data, QString &error);
+
+ private:
+  typedef QSharedPointer<MappedFile> MappedFilePtr;
+
+  QString root;
+
+  // Open files, most recently used last. A file evicted while another thread
+  // is reading it stays open until that read completes.
+  QMutex filesMutex;
+  QHash<QString, MappedFilePtr> files;
+  QList<QString> fileOrder;
+  MappedFilePtr openFile(const QString &name, QString &error);
+};
+
+// A map archive holds every bundle file of a map in a single file, written
+// by util/mkarchive.py. All numbers are little-endian. It starts with a 
+// 32-byte header:
+//   - the magic "ZTMA" and a 32-bit format version, currently 1;
+//   - the 32-bit number of bundle files and the 32-bit size of the name
+//     table;
+//   - the 64-bit offsets of the directory and of the name table.
+// The directory has an entry of 24 bytes per bundle file, sorted by the 
+// 64-bit FNV-1a hash of the file's name: the hash, the 64-bit offset of the
+// file's data, its 32-bit length, and the 32-bit position of its name within
+// the name table. Names are UTF-8, '/'-separated and NUL-terminated. The
+// data of each file starts on an 8-byte boundary.
+//
+// Opening an archive maps it and checks the header without reading the 
+// directory, and reads from a mapped archive are not copied.
+class MapArchive : public LocalMapSource {
+ public:
+  MapArchive();
+
+  bool open(const QString &path, QString &error);
+
+  int numFiles() const { return count; }
+
+  // Find a bundle file. Returns false if the archive does not contain it.
+  bool find(const QString &name, quint64 &offset, uint32_t &len) const;
+
+  virtual bool read(const QString &name, uint32_t offset, uint32_t len, 
+                    QByteArray &data, QString &error);
+
+ private:
+  MappedFile file;
+  int count;
+
+  // The directory and name table, within the mapping or, if the archive 
+  // could not be mapped, read into memory
+  const uchar *directory;
+  const char *names;
+  uint32_t namesSize;
+  QByteArray directoryCopy, namesCopy;
+};
+
+#endif
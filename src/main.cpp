@@ -110,9 +110,31 @@ int main(int argc, char **argv)
   }
   Map *map = rootData.maps().values()[0];
 
+  // The map may be read from elsewhere, such as a file: URL naming a copy of
+  // its bundle directory, or a map archive, for offline use
+  QString mapBaseUrl = settings.value(settingMapBaseUrl, "").toString();
+  if (!mapBaseUrl.isEmpty()) {
+    map->setBaseUrl(QUrl(mapBaseUrl));
+  }
+
   int maxMemCache = settings.value(settingMemCache, 64).toInt();
   int maxDiskCache = settings.value(settingDiskCache, 200).toInt();
-  Cache::Cache tileCache(map, networkManager, maxMemCache, maxDiskCache, cachePath);
+  int ioThreads = settings.value(settingIOThreads, 0).toInt();
+  Cache::Cache tileCache(map, networkManager, maxMemCache, maxDiskCache, cachePath,
+                         ioThreads);
+  tileCache.setCompressedCacheSize(settings.value(settingCompressedCache, 32).toInt());
+  tileCache.setPrefetchCacheSize(settings.value(settingPrefetchCache, 16).toInt());
+  int memoryPolicy = settings.value(settingMemoryPolicy, 
+                                    Cache::SegmentedLRUPolicyKind).toInt();
+  if (memoryPolicy != Cache::LRUPolicyKind && 
+      memoryPolicy != Cache::SegmentedLRUPolicyKind) {
+    qWarning("Unknown memory policy %d; using segmented LRU", memoryPolicy);
+    memoryPolicy = Cache::SegmentedLRUPolicyKind;
+  }
+  tileCache.setMemoryPolicy(Cache::MemoryPolicyKind(memoryPolicy));
+  tileCache.setTraceFile(settings.value(settingCacheTraceFile, "").toString());
+  tileCache.setSaveLocalObjects(settings.value(settingSaveLocalMaps, false).toBool());
+  tileCache.setIndexedTiles(settings.value(settingIndexedTiles, false).toBool());
   MapRenderer renderer(map, tileCache);
   MainWindow *window = new MainWindow(rootData, map, &renderer, tileCache, 
                                       networkManager);
@@ -17,6 +17,7 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <QChar>
 #include <QComboBox>
@@ -34,6 +35,8 @@
 #include <QPageSetupDialog>
 #include <QPrintDialog>
 #include <QPrinter>
+#include <QProgressDialog>
+#include <QMessageBox>
 #include <QRegExp>
 #include <QSizeF>
 #include <QSettings>
@@ -44,6 +47,7 @@
 #include <QToolBar>
 #include <QTreeView>
 #include <QXmlDefaultHandler>
+#include "areadownload.h"
 #include "mainwindow.h"
 #include "mapwidget.h"
 #include "map.h"
@@ -66,6 +70,15 @@ static const int retryTimeout = 500;
 
 QString settingMemCache = "maxMemCache";
 QString settingDiskCache = "maxDiskCache";
+QString settingIOThreads = "ioThreads";
+QString settingCompressedCache = "maxCompressedCache";
+QString settingPrefetchCache = "maxPrefetchCache";
+QString settingAreaDownload = "areaDownload";
+QString settingMemoryPolicy = "memoryPolicy";
+QString settingCacheTraceFile = "cacheTraceFile";
+QString settingMapBaseUrl = "mapBaseUrl";
+QString settingSaveLocalMaps = "saveLocalMaps";
+QString settingIndexedTiles = "indexedTiles";
 QString settingDpi = "screenDpi";
 QString settingUseOpenGL = "useOpenGL";
 
@@ -74,7 +87,8 @@ QVector<MainWindow *> windowList;
 MainWindow::MainWindow(const RootData &d, Map *m, MapRenderer *r, Cache::Cache &c, 
                        QNetworkAccessManager &mgr, QWidget *parent)
   : QMainWindow(parent), rootData(d), map(m), renderer(r), tileCache(c), 
-    networkManager(mgr), pendingSearch(NULL), printer(QPrinter::HighResolution)
+    networkManager(mgr), pendingSearch(NULL), printer(QPrinter::HighResolution),
+    areaDownload(NULL), areaDownloadDialog(NULL)
 {
   setAttribute(Qt::WA_DeleteOnClose);
   setWindowTitle(tr("Topographic Map Viewer"));
@@ -289,6 +303,12 @@ void MainWindow::createActions()
   printAction->setShortcuts(QKeySequence::Print);
   connect(printAction, SIGNAL(triggered(bool)), this, SLOT(printTriggered(bool)));
 
+  downloadAreaAction = new QAction(tr("&Download Area for Offline Use..."), this);
+  connect(downloadAreaAction, SIGNAL(triggered(bool)), 
+          this, SLOT(downloadAreaTriggered()));
+  // A map read from the local file system is already available offline
+  downloadAreaAction->setEnabled(!tileCache.isLocal());
+
   closeAction = new QAction(tr("&Close"), this);
   connect(closeAction, SIGNAL(triggered(bool)), this, SLOT(close()));
 
@@ -482,6 +502,8 @@ void MainWindow::createMenus()
   fileMenu->addSeparator();
   fileMenu->addAction(printAction);
   fileMenu->addAction(pageSetupAction);
+  fileMenu->addSeparator();
+  fileMenu->addAction(downloadAreaAction);
 #ifndef Q_WS_MAC
   // The "Close" menu item doesn't fit into the Mac UI guidelines; Qt automatically generates
   // a suitable menu item anyway.
@@ -916,3 +938,127 @@ void MainWindow::cacheIOError(const QString &msg)
 {
   statusBar()->showMessage(msg, statusMessageTimeout);
 }
+
+void MainWindow::downloadAreaTriggered()
+{
+  if (areaDownload) {
+    statusBar()->showMessage(tr("An area download is already in progress"), 
+                             statusMessageTimeout);
+    return;
+  }
+
+  // An interrupted download is saved in the settings until it completes
+  QSettings settings;
+  QVariantList saved = settings.value(settingAreaDownload).toList();
+  if (saved.size() == 5 && saved[0].toString() == map->id() &&
+      QMessageBox::question(this, tr("Download Area"), 
+                            tr("Resume the interrupted area download?"),
+                            QMessageBox::Yes | QMessageBox::No) == 
+      QMessageBox::Yes) {
+    areaDownload = new AreaDownload(map, tileCache, networkManager, 
+                                    saved[1].toInt(), saved[2].toRect(), 
+                                    saved[3].toInt(), saved[4].toInt(), this);
+  } else {
+    // Download the visible area, from the current level to the most detailed
+    int layer = view->currentLayer();
+    int maxLevel = map->layer(layer).maxLevel();
+    int level = std::min(map->zoomLevel(view->currentScale()), maxLevel);
+    areaDownload = new AreaDownload(map, tileCache, networkManager, layer, 
+                                    view->visibleArea(), level, maxLevel, this);
+  }
+  connect(areaDownload, SIGNAL(planned(int, qint64)), 
+          this, SLOT(areaDownloadPlanned(int, qint64)));
+  connect(areaDownload, SIGNAL(progress(qint64, qint64)), 
+          this, SLOT(areaDownloadProgress(qint64, qint64)));
+  connect(areaDownload, SIGNAL(finished(bool)), 
+          this, SLOT(areaDownloadFinished(bool)));
+  statusBar()->showMessage(tr("Estimating the size of the download..."));
+  areaDownload->plan();
+}
+
+void MainWindow::areaDownloadPlanned(int tiles, qint64 bytes)
+{
+  statusBar()->clearMessage();
+  QString msg = tr("Download %1 tiles (about %2 MB)? %3 tiles of this area "
+                   "are already cached.")
+    .arg(tiles).arg(qreal(bytes) / bytesPerMb, 0, 'f', 1)
+    .arg(areaDownload->numCachedTiles());
+  if (bytes > qint64(tileCache.getDiskCacheSize()) * bytesPerMb) {
+    msg += "\n\n" % tr("This is more than the disk cache can hold (%1 MB). "
+                        "Increase its size in the preferences first, or "
+                        "some of the tiles will be discarded.")
+      .arg(tileCache.getDiskCacheSize());
+  }
+  if (tiles == 0 || 
+      QMessageBox::question(this, tr("Download Area"), msg, 
+                            QMessageBox::Ok | QMessageBox::Cancel) != 
+      QMessageBox::Ok) {
+    if (tiles == 0) {
+      QSettings settings;
+      settings.remove(settingAreaDownload);
+      statusBar()->showMessage(tr("This area is already cached"), 
+                               statusMessageTimeout);
+    }
+    areaDownload->deleteLater();
+    areaDownload = NULL;
+    return;
+  }
+
+  QSettings settings;
+  settings.setValue(settingAreaDownload, QVariantList() << map->id() 
+                    << areaDownload->layer() << areaDownload->area() 
+                    << areaDownload->minLevel() << areaDownload->maxLevel());
+
+  areaDownloadDialog = new QProgressDialog(tr("Downloading area..."), 
+                                           tr("Cancel"), 0, 1000, this);
+  areaDownloadDialog->setWindowModality(Qt::NonModal);
+  areaDownloadDialog->setMinimumDuration(0);
+  connect(areaDownloadDialog, SIGNAL(canceled()), 
+          this, SLOT(areaDownloadCanceled()));
+  areaDownloadDialog->show();
+  areaDownload->start();
+}
+
+void MainWindow::areaDownloadProgress(qint64 done, qint64 total)
+{
+  if (areaDownloadDialog && total > 0) {
+    areaDownloadDialog->setValue(int(done * 1000 / total));
+    areaDownloadDialog->setLabelText(tr("Downloading area: %1 of %2 MB")
+      .arg(qreal(done) / bytesPerMb, 0, 'f', 1)
+      .arg(qreal(total) / bytesPerMb, 0, 'f', 1));
+  }
+}
+
+void MainWindow::areaDownloadFinished(bool ok)
+{
+  if (ok) {
+    QSettings settings;
+    settings.remove(settingAreaDownload);
+    statusBar()->showMessage(tr("Area download complete"), statusMessageTimeout);
+  } else {
+    statusBar()->showMessage(tr("%1 tiles could not be downloaded; download the "
+                                "area again to resume")
+                             .arg(areaDownload->numFailedTiles()),
+                             statusMessageTimeout);
+  }
+  if (areaDownloadDialog) {
+    areaDownloadDialog->deleteLater();
+    areaDownloadDialog = NULL;
+  }
+  areaDownload->deleteLater();
+  areaDownload = NULL;
+}
+
+void MainWindow::areaDownloadCanceled()
+{
+  if (!areaDownload) {
+    return;
+  }
+  areaDownload->cancel();
+  areaDownload->deleteLater();
+  areaDownload = NULL;
+  areaDownloadDialog->deleteLater();
+  areaDownloadDialog = NULL;
+  statusBar()->showMessage(tr("Area download stopped; download the area again "
+                              "to resume"), statusMessageTimeout);
+}
@@ -31,6 +31,7 @@
 #include "maprenderer.h"
 
 class Cache::Cache;
+class AreaDownload;
 class QActionGroup;
 class QComboBox;
 class QDockWidget;
@@ -41,6 +42,7 @@ class QStackedWidget;
 class QStandardItemModel;
 class QTreeView;
 class QNetworkAccessManager;
+class QProgressDialog;
 
 class Map;
 class MapRenderer;
@@ -81,7 +83,11 @@ class PrintJob : public QObject {
   QTimer retryTimer;
 };
 
-extern QString settingMemCache, settingDiskCache, settingDpi;
+extern QString settingMemCache, settingDiskCache, settingCompressedCache;
+extern QString settingPrefetchCache, settingAreaDownload;
+extern QString settingIOThreads, settingMemoryPolicy, settingCacheTraceFile;
+extern QString settingMapBaseUrl, settingSaveLocalMaps, settingIndexedTiles;
+extern QString settingDpi;
 
 enum ViewKind {
   MapKind = 0,
@@ -137,6 +143,12 @@ private slots:
   void searchResultActivated(const QModelIndex &);
 
   void cacheIOError(const QString &msg);
+
+  void downloadAreaTriggered();
+  void areaDownloadPlanned(int tiles, qint64 bytes);
+  void areaDownloadProgress(qint64 done, qint64 total);
+  void areaDownloadFinished(bool ok);
+  void areaDownloadCanceled();
 private:
   const RootData &rootData;
   Map *map;
@@ -188,10 +200,15 @@ private:
   QPrinter printer;
   QList<PrintJob *> printJobs;
 
+  // Download of an area for offline use, if one is in progress
+  AreaDownload *areaDownload;
+  QProgressDialog *areaDownloadDialog;
+
   // Actions
   QAction *newWindowAction;
   QAction *printAction;
   QAction *pageSetupAction;
+  QAction *downloadAreaAction;
   QAction *closeAction;
 
   QActionGroup *viewActionGroup;
@@ -136,6 +136,7 @@ public:
   QSize requestedSize() const { return reqSize; }
 
   QUrl baseUrl() const { return fBaseUrl; }
+  void setBaseUrl(const QUrl &url) { fBaseUrl = url; }
 
   // Filename of a given tile
   QString tilePath(Tile t) const;
@@ -33,6 +33,7 @@
 #include "consts.h"
 #include "map.h"
 #include "maprenderer.h"
+#include "pixelkernels.h"
 #include "projection.h"
 #include <iostream>
 #include <cstdio>
@@ -43,14 +44,21 @@ static const int maxGridLines = 100;
 
 static const int pruneTimeout = 1000;
 
+// Size of the cache of expanded indexed tiles between renders, in KB
+static const int minExpandedTiles = 16 * 1024;
+
+// Most of the memory cache budget the expanded tiles may take during a render
+static const int expandedTilesShare = 4;  // a quarter
+
 GridTick::GridTick(Direction d, qreal m, qreal g)
   : side(d), mapPos(m), gridPos(g)
 {
 }
 
 MapRenderer::MapRenderer(Map *m, Cache::Cache &c, QObject *parent)
-  : QObject(parent), map(m), tileCache(c)
+  : QObject(parent), map(m), tileCache(c), expandedTiles(minExpandedTiles)
 {
+  expandedTiles.setMaxCost(std::min(minExpandedTiles, maxExpandedTiles()));
   for (int d = 0; d < numDatums; d++) {
     for (int z = 0; z < UTM::numZones; z++) {
       zoneBoundaries[d][z] = NULL;
@@ -80,6 +88,55 @@ void MapRenderer::bumpScale(int layer, qreal scale, qreal &bumpedScale,
   bumpedScale = float(bumpedTileSize) / float(tileSize);
 }
 
+int MapRenderer::maxExpandedTiles() const
+{
+  return tileCache.getMemCacheSize() * 1024 / expandedTilesShare;
+}
+
+void MapRenderer::insertExpandedTile(const ExpandedTileKey &key, 
+                                     QPixmap *pixmap)
+{
+  expandedTiles.insert(key, pixmap, 
+                       pixmap->width() * pixmap->height() * pixmap->depth() / 
+                       8192);
+}
+
+QPixmap MapRenderer::expandTile(const Tile &t, const QImage &image)
+{
+  ExpandedTileKey key(QPair<int, qkey>(t.layer(), t.toQuadKey()), 0);
+  QPixmap *expanded = expandedTiles.object(key);
+  if (!expanded) {
+    expanded = new QPixmap(QPixmap::fromImage(expandIndexedImage(image)));
+    insertExpandedTile(key, expanded);
+  }
+  return *expanded;
+}
+
+QPixmap MapRenderer::halveTile(const Tile &t, const QImage &image)
+{
+  ExpandedTileKey key(QPair<int, qkey>(t.layer(), t.toQuadKey()), 1);
+  QPixmap *halved = expandedTiles.object(key);
+  if (!halved) {
+    QImage half(image.size() / 2, QImage::Format_ARGB32_Premultiplied);
+    downsampleImage(image, half, 0, 0);
+    halved = new QPixmap(QPixmap::fromImage(half));
+    insertExpandedTile(key, halved);
+  }
+  return *halved;
+}
+
+bool MapRenderer::getTilePixmap(const Tile &t, QPixmap &pixmap)
+{
+  QImage image;
+  if (!tileCache.getTile(t, pixmap, image)) {
+    return false;
+  }
+  if (!image.isNull()) {
+    pixmap = expandTile(t, image);
+  }
+  return true;
+}
+
 void MapRenderer::drawTile(Tile key, QPainter &p, const QRect &dstRect)
 {
   int logTileSize = map->logBaseTileSize();
@@ -90,7 +147,7 @@ void MapRenderer::drawTile(Tile key, QPainter &p, const QRect &dstRect)
   for (int layer = key.layer(); layer >= 0; layer--) {
     Tile t(key.x(), key.y(), key.level(), layer);
 
-    if (tileCache.getTile(key, pixmap)) {
+    if (getTilePixmap(key, pixmap)) {
       p.drawPixmap(dstRect, pixmap, QRect(0, 0, 1 << logTileSize, 1 << logTileSize));
       return;
     }
@@ -103,7 +160,7 @@ void MapRenderer::drawTile(Tile key, QPainter &p, const QRect &dstRect)
     for (int layer = key.layer(); !doneAbove && layer >= 0; layer--) {
       Tile t(key.x() >> deltaLevel, key.y() >> deltaLevel, level, layer);
 
-      if (tileCache.getTile(t, pixmap)) {
+      if (getTilePixmap(t, pixmap)) {
         // Size of the destination tile in the source space
         int logSubSize = logTileSize - deltaLevel;
         int mask = (1 << deltaLevel) - 1;
@@ -128,14 +185,26 @@ void MapRenderer::drawTile(Tile key, QPainter &p, const QRect &dstRect)
         for (int layer = map->numLayers() - 1; !found && layer >= 0; layer--) {
           Tile t((key.x() << deltaLevel) + x, (key.y() << deltaLevel) + y, 
                  level, layer);
-          if (tileCache.getTile(t, pixmap)) {
+          QImage image;
+          if (tileCache.getTile(t, pixmap, image)) {
             // Size of the source tile in the destination space
             qreal dstSizeX = qreal(dstRect.width()) / qreal(1 << deltaLevel);
             qreal dstSizeY = qreal(dstRect.height()) / qreal(1 << deltaLevel);
             QRectF dstSubRect(dstRect.left() + dstSizeX * x, 
                               dstRect.top() + dstSizeY * y, dstSizeX, dstSizeY);
-            p.drawPixmap(dstSubRect, pixmap, 
-                         QRectF(0, 0, 1 << logTileSize, 1 << logTileSize));
+            QRect halfRect = dstSubRect.toRect();
+            if (!image.isNull() && QRectF(halfRect) == dstSubRect &&
+                halfRect.size() * 2 == image.size()) {
+              // Drawn at exactly half size, an indexed tile is box filtered
+              // straight from its indices, without expanding it first
+              p.drawPixmap(halfRect.topLeft(), halveTile(t, image));
+            } else {
+              if (!image.isNull()) {
+                pixmap = expandTile(t, image);
+              }
+              p.drawPixmap(dstSubRect, pixmap, 
+                           QRectF(0, 0, 1 << logTileSize, 1 << logTileSize));
+            }
             found = true;
           }
         }
@@ -156,6 +225,15 @@ void MapRenderer::render(QPainter &p, int layer, QRect mr, qreal scale)
 
   QRect visibleTiles = map->mapRectToTileRect(mr, level);
 
+  // Make room for the expanded tiles of this render, within a share of the
+  // memory budget, so it doesn't evict its own tiles; the cache is trimmed
+  // back once the render is done
+  int tileSize = 1 << map->logBaseTileSize();
+  int restCost = std::min(minExpandedTiles, maxExpandedTiles());
+  int renderCost = visibleTiles.width() * visibleTiles.height() * 
+    (tileSize * tileSize * 4 / 1024);
+  expandedTiles.setMaxCost(qBound(restCost, renderCost, maxExpandedTiles()));
+
   p.save();
   p.setCompositionMode(QPainter::CompositionMode_Source);
   
@@ -180,6 +258,7 @@ void MapRenderer::render(QPainter &p, int layer, QRect mr, qreal scale)
   }
 
   p.restore();
+  expandedTiles.setMaxCost(restCost);
 }
 
 // Add tiles that are no longer visible to the LRU list
@@ -208,6 +287,34 @@ bool MapRenderer::loadTiles(int layer, QRect vis, qreal scale)
   return tileCache.requestTiles(tiles);
 }
 
+void MapRenderer::addTiles(QList<Tile> &tiles, int layer, QRect area, int level)
+{
+  QRect r = map->mapRectToTileRect(area, level);
+  for (int x = r.left(); x <= r.right(); x++) {
+    for (int y = r.top(); y <= r.bottom(); y++) {
+      tiles << Tile(x, y, level, layer);
+    }
+  }
+}
+
+void MapRenderer::prefetchTiles(int layer, QRect vis, QRect ahead, qreal scale,
+                                int zoomDirection)
+{
+  int maxLevel = map->layer(layer).maxLevel();
+  int level = std::min(map->zoomLevel(scale), maxLevel);
+
+  // Nearest first, so the most likely tiles are queued before the rest
+  QList<Tile> tiles;
+  addTiles(tiles, layer, ahead, level);
+  if (level - 1 >= map->minLevel()) {
+    addTiles(tiles, layer, ahead, level - 1);
+  }
+  if (zoomDirection > 0 && level + 1 <= maxLevel) {
+    addTiles(tiles, layer, vis, level + 1);
+  }
+  tileCache.prefetchTiles(tiles);
+}
+
 QPointF MapRenderer::mapToView(QPoint origin, qreal scale, QPointF p)
 {
   return (p - QPointF(origin)) * scale;
@@ -21,6 +21,7 @@
 #define MAPRENDERER_H 1
 
 
+#include <QCache>
 #include <QImage>
 #include <QList>
 #include <QMap>
@@ -74,6 +75,12 @@ public:
   // place.
   // Returns true if all the tiles are present in memory.
   bool loadTiles(int layer, QRect area, qreal scale);
+
+  // Speculatively load tiles the view is likely to need next: the area ahead 
+  // of the current motion at the current and next coarser levels, and the
+  // visible area at the next finer level if zooming in.
+  void prefetchTiles(int layer, QRect vis, QRect ahead, qreal scale, 
+                     int zoomDirection);
   
   // Render an area of a map layer onto a paint device at a given scale
   // Does not clip precisely to the map boundary; the area drawn may lie over
@@ -112,8 +119,22 @@ private:
   //  void findTile(Tile key, QPixmap &p, QRect &r);
   void drawTile(Tile key, QPainter &p, const QRect &r);
 
+  // Tiles the cache keeps in indexed form are expanded to pixmaps when 
+  // drawn, or halved when drawn at half size. The most recently drawn are
+  // kept, since views redraw often. Keys are a tile's layer and quadkey, and
+  // 1 for a halved tile.
+  typedef QPair<QPair<int, qkey>, int> ExpandedTileKey;
+  QCache<ExpandedTileKey, QPixmap> expandedTiles;
+  int maxExpandedTiles() const;
+  void insertExpandedTile(const ExpandedTileKey &key, QPixmap *pixmap);
+  QPixmap expandTile(const Tile &t, const QImage &image);
+  QPixmap halveTile(const Tile &t, const QImage &image);
+  bool getTilePixmap(const Tile &t, QPixmap &pixmap);
+
   QPointF mapToView(QPoint origin, qreal scale, QPointF p);
 
+  void addTiles(QList<Tile> &tiles, int layer, QRect area, int level);
+
   void rulerInterval(qreal length, qreal &interval, int &ilog);
 
   // Render a grid on a projection
@@ -33,6 +33,15 @@
 #include <iostream>
 #include <cstdio>
 
+// How far ahead of the current motion of the view to prefetch tiles (ms)
+static const int prefetchLookahead = 500;
+
+// Motion older than this is assumed to have stopped (ms)
+static const int motionTimeout = 250;
+
+// How long after a zoom to keep prefetching the next level in (ms)
+static const int zoomTimeout = 2000;
+
 MapWidget::MapWidget(Map *m, MapRenderer *r, bool useGL, QWidget *parent)
   : QAbstractScrollArea(parent), map(m), renderer(r)
 {
@@ -48,6 +57,8 @@ MapWidget::MapWidget(Map *m, MapRenderer *r, bool useGL, QWidget *parent)
   setDpi(0);
 
   panning = false;
+  lastScale = 0.0;
+  zoomDirection = 0;
 
   gridEnabled = false;
   showRuler = true;
@@ -119,6 +130,12 @@ void MapWidget::zoomChanged()
   renderer->bumpScale(layer, scaleFactor * scaleStep, bumpedScale, bumpedTileSize);
   //  bumpedScale = scaleFactor * scaleStep;
 
+  if (lastScale > 0.0 && bumpedScale != lastScale) {
+    zoomDirection = bumpedScale > lastScale ? 1 : -1;
+    zoomTime.start();
+  }
+  lastScale = bumpedScale;
+
   updateScrollBars();
 
   emit(mapScaleChanged(currentMapScale()));
@@ -252,6 +269,39 @@ void MapWidget::tilesChanged()
 {
   QRect vis(visibleArea());
   renderer->loadTiles(currentLayer(), vis, currentScale());
+
+  // Track a smoothed velocity of the view center
+  QPoint c = center();
+  if (!motionTime.isValid() || motionTime.elapsed() > motionTimeout) {
+    panVelocity = QPointF();
+    motionTime.start();
+  } else {
+    int dt = motionTime.elapsed();
+    if (dt > 0) {
+      QPointF v = QPointF(c - lastCenter) / dt;
+      panVelocity = 0.5 * panVelocity + 0.5 * v;
+      motionTime.start();
+    }
+  }
+  lastCenter = c;
+
+  // Prefetch where the view will be shortly, or a margin around a still view
+  QPointF d = panVelocity * prefetchLookahead;
+  d.setX(std::max(-qreal(vis.width()), std::min(qreal(vis.width()), d.x())));
+  d.setY(std::max(-qreal(vis.height()), std::min(qreal(vis.height()), d.y())));
+  QRect ahead;
+  if (std::abs(d.x()) < vis.width() / 8 && std::abs(d.y()) < vis.height() / 8) {
+    int w = vis.width() / 4, h = vis.height() / 4;
+    ahead = vis.adjusted(-w, -h, w, h);
+  } else {
+    ahead = vis.united(vis.translated(d.toPoint()));
+  }
+
+  int zoom = 0;
+  if (zoomTime.isValid() && zoomTime.elapsed() < zoomTimeout) {
+    zoom = zoomDirection;
+  }
+  renderer->prefetchTiles(currentLayer(), vis, ahead, currentScale(), zoom);
 }
 
 void MapWidget::paintEvent(QPaintEvent *ev)
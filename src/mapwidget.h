@@ -25,6 +25,7 @@
 #include <QMap>
 #include <QPair>
 #include <QPixmap>
+#include <QTime>
 
 #include "map.h"
 #include "maprenderer.h"
@@ -118,6 +119,14 @@ private:
   QPoint lastMousePos;
   bool panning; // Are we in the middle of a panning event?
 
+  // Recent motion of the view, used to predict which tiles to prefetch
+  QPoint lastCenter;
+  QTime motionTime;
+  QPointF panVelocity; // Map units per millisecond
+  qreal lastScale;
+  int zoomDirection;   // +1 zooming in, -1 zooming out
+  QTime zoomTime;
+
   // Current layer; negative means choose automatically
   int selectedLayer;
 
@@ -19,11 +19,11 @@
 
 #include <QFile>
 #include <QImage>
-#include <QPainter>
 #include <QVector>
 #include <cstdio>
 #include <cstdlib>
 #include "map.h"
+#include "pixelkernels.h"
 #include "rootdata.h"
 
 using namespace std;
@@ -76,11 +76,8 @@ int main(int argc, char **argv)
         Tile to(x, y, level, layer);
         QImage image = QImage(256, 256, QImage::Format_RGB32);
         image.fill(QColor(255, 255, 255).rgb());
-        QPainter p;
         bool isNull = true;
         QVector<QRgb> colorTable;
-        p.begin(&image);
-        p.setRenderHint(QPainter::SmoothPixmapTransform, true);
         for (int dy = 0; dy <= 1; dy++) {
           for (int dx = 0; dx <= 1; dx++) {
             Tile from(x * 2 + dx, y * 2 + dy, level + 1, layer);
@@ -88,17 +85,14 @@ int main(int argc, char **argv)
             QImage tile(tilePath);
             if (!tile.isNull()) {
               isNull = false;
-              QRect target(dx * tileSize / 2, dy * tileSize / 2, 
-                           tileSize / 2, tileSize / 2);
-              p.drawImage(target, tile);
+              // A 2x2 box filter, as smooth scaling by exactly a half is
+              downsampleImage(tile, image, dx * tileSize / 2, dy * tileSize / 2);
               colorTable = tile.colorTable();
             }
           }
         }
-        p.end();
         if (!isNull) {
-          QImage indexImage = image.convertToFormat(QImage::Format_Indexed8, 
-                                                    colorTable, Qt::ThresholdDither);
+          QImage indexImage = quantizeImage(image, colorTable);
           indexImage.save(map->tilePath(to), "png");
         }
       }
@@ -0,0 +1,765 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Network benchmark for the tile cache. Replays a scripted sequence of pans
+// and zooms against a map server, usually util/rangeserver.py serving a local
+// copy of the map bundles, and reports how long each viewport took to load
+// and how many requests and bytes it cost. A file: base URL reads the
+// bundles directly instead, for comparison.
+//
+// Script lines are:
+//   view <x> <y> <scale>     jump to map point (x, y) at a scale factor
+//   pan <dx> <dy> <steps>    pan by (dx, dy) screen pixels over several steps
+//   zoom <factor> <steps>    multiply the scale factor over several steps
+// Steps of a pan or zoom are issued every step interval without waiting for
+// the tiles to load, as when dragging the map; each line is timed until the
+// tiles of its final viewport are all in memory.
+//
+// With -q, instead times queueing a number of synthetic network requests,
+// with -r, finding the tiles of a synthetic index, with -d, drawing tiles
+// kept as pixmaps against tiles kept as indexed images, with -k, each
+// version of the pixel kernels, with -p, decoding tile PNGs, and with -o,
+// loading tiles from the disk cache with 1, 2, 4 and 8 IO threads, and with
+// -u, starting up with a disk cache of 10^4 or more objects, without a
+// server. "-f indexed" keeps tiles as indexed images while replaying.
+
+#include <QApplication>
+#include <QBuffer>
+#include <QDebug>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QMetaType>
+#include <QPainter>
+#include <QNetworkAccessManager>
+#include <QStringList>
+#include <QTextStream>
+#include <QTime>
+#include <QTimer>
+#include <QUrl>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include "map.h"
+#include "maprenderer.h"
+#include "pixelkernels.h"
+#include "rootdata.h"
+#include "tilecache.h"
+#include "tiledecoder.h"
+#include "tileindex.h"
+
+using namespace std;
+
+// How often to re-check a viewport that is still loading, in ms
+static const int pollInterval = 100;
+
+class BenchClient : public MapRendererClient {
+public:
+  BenchClient(Map *m, int l) : map(m), selectedLayer(l) { }
+
+  int layer() const {
+    return selectedLayer < 0 ? map->bestLayerAtLevel(map->zoomLevel(scale))
+      : selectedLayer;
+  }
+  virtual int currentLayer() const { return layer(); }
+  virtual QRect visibleArea() const {
+    QSize s(int(viewSize.width() / scale), int(viewSize.height() / scale));
+    return QRect(center - QPoint(s.width() / 2, s.height() / 2), s);
+  }
+
+  Map *map;
+  int selectedLayer;
+  QSize viewSize;
+  QPoint center;
+  qreal scale;
+};
+
+// Run the event loop for ms milliseconds, or until a tile loads if cache is 
+// not NULL
+static void runEvents(Cache::Cache *cache, int ms)
+{
+  QEventLoop loop;
+  if (cache) {
+    QObject::connect(cache, SIGNAL(tileLoaded()), &loop, SLOT(quit()));
+  }
+  QTimer::singleShot(ms, &loop, SLOT(quit()));
+  loop.exec();
+}
+
+// A synthetic 256x256 indexed tile with the given number of colors
+static QImage syntheticTile(int colors)
+{
+  const int size = 256;
+  QVector<QRgb> palette;
+  for (int i = 0; i < colors; i++) {
+    palette << qRgb(i, (i * 7) & 0xff, 255 - i);
+  }
+  QImage image(size, size, QImage::Format_Indexed8);
+  image.setColorTable(palette);
+  for (int y = 0; y < size; y++) {
+    uchar *line = image.scanLine(y);
+    for (int x = 0; x < size; x++) {
+      line[x] = uchar((x / 4 + (y / 4) * 3) % colors);
+    }
+  }
+  return image;
+}
+
+// The same tile, encoded as a PNG
+static QByteArray syntheticTilePng(int colors)
+{
+  QByteArray png;
+  QBuffer buffer(&png);
+  buffer.open(QIODevice::WriteOnly);
+  syntheticTile(colors).save(&buffer, "PNG");
+  return png;
+}
+
+// Ways of drawing a tile
+enum DrawMode {
+  DrawPixmap,        // Kept as a pixmap
+  DrawExpanded,      // Kept indexed, and expanded to a pixmap for each draw
+  DrawKernels,       // Likewise, expanded with the pixel kernels
+  DrawIndexed        // Kept indexed, and drawn as an image
+};
+
+static int timeDraws(QPainter &p, int n, DrawMode mode, const QPixmap &pixmap,
+                     const QImage &image, const QRect &src)
+{
+  QTime time;
+  time.start();
+  for (int i = 0; i < n; i++) {
+    QRect dst((i % 4) * image.width(), (i / 4 % 3) * image.height(),
+              image.width(), image.height());
+    switch (mode) {
+    case DrawPixmap: p.drawPixmap(dst, pixmap, src); break;
+    case DrawExpanded: p.drawPixmap(dst, QPixmap::fromImage(image), src); break;
+    case DrawKernels: 
+      p.drawPixmap(dst, QPixmap::fromImage(expandIndexedImage(image)), src); 
+      break;
+    case DrawIndexed: p.drawImage(dst, image, src); break;
+    }
+  }
+  return time.elapsed();
+}
+
+// Time drawing n synthetic 256x256 tiles each way, at full size and scaled
+// up from a quarter of a coarser tile, onto a 32-bit image
+static void benchmarkTileDrawing(int n)
+{
+  const int size = 256;
+  QImage image = syntheticTile(256);
+  QPixmap pixmap = QPixmap::fromImage(image);
+
+  QImage target(4 * size, 3 * size, QImage::Format_ARGB32_Premultiplied);
+  QPainter p(&target);
+  p.setCompositionMode(QPainter::CompositionMode_Source);
+  p.setRenderHint(QPainter::SmoothPixmapTransform);
+  QRect full(0, 0, size, size), quarter(0, 0, size / 2, size / 2);
+
+  const char *names[] = { "pixmap", "indexed, expanded", "indexed, kernels",
+                          "indexed, as image" };
+  for (int mode = DrawPixmap; mode <= DrawIndexed; mode++) {
+    int fullTime = timeDraws(p, n, DrawMode(mode), pixmap, image, full);
+    int scaledTime = timeDraws(p, n, DrawMode(mode), pixmap, image, quarter);
+    printf("%-20s %8.1f us per tile, %8.1f us scaled\n", names[mode],
+           fullTime * 1000.0 / n, scaledTime * 1000.0 / n);
+  }
+  printf("Memory per tile: %d bytes as a pixmap, %d indexed\n", 
+         size * size * pixmap.depth() / 8, image.bytesPerLine() * size);
+}
+
+// Time n passes of each version of the pixel kernels over a 256x256 tile,
+// and check that every version agrees with the scalar one
+static void benchmarkPixelKernels(int n)
+{
+  QImage tile = syntheticTile(200);
+  QVector<QRgb> palette = tile.colorTable();
+  const int pixels = tile.width() * tile.height();
+  const int half = tile.width() / 2;
+
+  QVector<QRgb> expected(pixels), expanded(pixels);
+  QVector<QRgb> expectedHalved(half), halved(half);
+  QVector<uchar> nearest(pixels), expectedNearest(pixels);
+  QList<const PixelKernels *> kernels = supportedPixelKernels();
+  printf("Using %s kernels\n", pixelKernels().name);
+  for (int v = 0; v < kernels.size(); v++) {
+    const PixelKernels &k = *kernels[v];
+    QTime time;
+    time.start();
+    for (int i = 0; i < n; i++) {
+      k.expandPalette(tile.bits(), expanded.data(), pixels, palette.constData());
+    }
+    int expandTime = time.restart();
+    for (int i = 0; i < n; i++) {
+      for (int y = 0; y < half; y++) {
+        const QRgb *row = expanded.constData() + 2 * y * tile.width();
+        k.downsampleRows(row, row + tile.width(), halved.data(), half);
+      }
+    }
+    int downsampleTime = time.restart();
+    // Colors a little off the palette, as a filtered tile's are
+    for (int i = 0; i < pixels; i++) {
+      nearest[i] = uchar(k.nearestColor(expanded[i] ^ 0x030303, 
+                                        palette.constData(), palette.size()));
+    }
+    int nearestTime = time.elapsed();
+
+    if (v == 0) {
+      expected = expanded;
+      expectedHalved = halved;
+      expectedNearest = nearest;
+    }
+    bool ok = expanded == expected && halved == expectedHalved &&
+      nearest == expectedNearest;
+    printf("%-8s expand %8.1f us, downsample %8.1f us per tile, nearest color"
+           " %6.3f us%s\n", k.name, expandTime * 1000.0 / n, 
+           downsampleTime * 1000.0 / n, nearestTime * 1000.0 / pixels,
+           ok ? "" : " (MISMATCH)");
+  }
+}
+
+// Time decoding n PNG tiles on one thread with Qt, against the tile decoder
+// with and without recycling its buffers, and check the decoder agrees
+static void benchmarkTileDecoding(int n)
+{
+  QByteArray png = syntheticTilePng(200);
+  QImage expected = QImage::fromData(png);
+  QImage expectedRgb = expandIndexedImage(expected);
+
+  TileDecoder decoder;
+  QTime time;
+  time.start();
+  for (int i = 0; i < n; i++) {
+    QImage image = QImage::fromData(png);
+  }
+  int qtTime = time.restart();
+  for (int i = 0; i < n; i++) {
+    QImage image = expandIndexedImage(QImage::fromData(png));
+  }
+  int qtExpandTime = time.restart();
+  for (int i = 0; i < n; i++) {
+    QImage image = decoder.decode(png, true);
+  }
+  int indexedTime = time.restart();
+  for (int i = 0; i < n; i++) {
+    QImage image = decoder.decode(png, false);
+  }
+  int expandTime = time.restart();
+  for (int i = 0; i < n; i++) {
+    QImage image = decoder.decode(png, false);
+    decoder.recycle(image);
+  }
+  int recycleTime = time.elapsed();
+
+  QImage indexed = decoder.decode(png, true), rgb = decoder.decode(png, false);
+  bool ok = indexed.colorTable() == expected.colorTable() && rgb == expectedRgb;
+  for (int y = 0; ok && y < indexed.height(); y++) {
+    ok = memcmp(indexed.constScanLine(y), expected.constScanLine(y), 
+                indexed.width()) == 0;
+  }
+
+  const char *names[] = { "Qt, indexed", "Qt, expanded", "decoder, indexed",
+                          "decoder, expanded", "decoder, recycled" };
+  int times[] = { qtTime, qtExpandTime, indexedTime, expandTime, recycleTime };
+  printf("%d byte PNG, using %s kernels\n", png.size(), pixelKernels().name);
+  for (int m = 0; m < 5; m++) {
+    printf("%-20s %8.1f us per tile, %8.0f tiles/s per core\n", names[m], 
+           times[m] * 1000.0 / n, times[m] ? n * 1000.0 / times[m] : 0.0);
+  }
+  printf("%d of %d decodes fell back to Qt, %d into reused buffers%s\n", 
+         decoder.numFallbacks(), decoder.numDecoded(), decoder.numReused(),
+         ok ? "" : " (MISMATCH)");
+}
+
+namespace Cache {
+  // Benchmarks of cache internals, kept out of the cache itself
+  class NetBench {
+  public:
+    // Time queueing and dequeueing n synthetic network requests, without
+    // sending them. The network queue must be empty.
+    static void networkQueue(Cache &c, int n);
+
+    // Time finding every tile of a synthetic index with numLevels levels, by
+    // walking the index tree and with the offset table.
+    static void tileRanges(Cache &c, int numLevels);
+
+    // Write numObjects synthetic tiles with the given data to the disk
+    // cache, then time loading them all back with the cache's IO threads.
+    // Returns the number of loads per second.
+    static qreal diskLoads(Cache &c, int numObjects, const QByteArray &data);
+
+    // Write timestamp records for numObjects synthetic objects of the given
+    // size, as a disk cache holding that many objects has.
+    static void writeSyntheticMetadata(Cache &c, int numObjects, uint32_t size);
+  };
+
+  void NetBench::networkQueue(Cache &c, int n)
+  {
+    assert(c.networkRequestQueue.empty());
+
+    // Tiles of similar size scattered over a few bundle files, with about 
+    // half of the positions in each file requested, in random order
+    const int files = 16;
+    const uint32_t tileLength = 16384;
+    QVector<int> positions(2 * n);
+    for (int i = 0; i < positions.size(); i++) {
+      positions[i] = i;
+    }
+    srand(1);
+    std::random_shuffle(positions.begin(), positions.end());
+
+    QTime time;
+    time.start();
+    for (int i = 0; i < n; i++) {
+      qkey qidx = files + positions[i] % files;
+      uint32_t offset = (positions[i] / files) * tileLength;
+      c.queueNetworkBundle(new NetworkRequestBundle(&c, c.map, qidx, offset, 
+                                                    tileKey(0, qidx), tileLength,
+                                                    &c));
+    }
+    int queueTime = time.elapsed();
+
+    int bundles = 0;
+    time.restart();
+    while (!c.networkRequestQueue.empty()) {
+      delete &*c.networkRequestQueue.begin();
+      bundles++;
+    }
+    qDebug() << "Queued " << n << " network requests as " << bundles 
+             << " bundles in " << queueTime << " ms; dequeued in " 
+             << time.elapsed() << " ms";
+  }
+
+  void NetBench::tileRanges(Cache &c, int numLevels)
+  {
+    // A synthetic index with random tile lengths
+    int size = 0;
+    for (int i = 1; i <= numLevels; i++) {
+      size += ((1 << (2 * (i + 1))) - 1) / 3;
+    }
+    QByteArray indexData(size * 4, 0);
+    uint32_t *idxData = (uint32_t *)indexData.data();
+    srand(1);
+    int base = 0;
+    for (int level = 1; level <= numLevels; level++) {
+      int nodes = ((1 << (2 * (level + 1))) - 1) / 3;
+      int leaves = 1 << (2 * level);
+      for (int k = nodes - 1; k >= 0; k--) {
+        if (k >= nodes - leaves) {
+          idxData[base + k] = rand() % 32768;
+        } else {
+          idxData[base + k] = idxData[base + 4 * k + 1] + idxData[base + 4 * k + 2] +
+            idxData[base + 4 * k + 3] + idxData[base + 4 * k + 4];
+        }
+      }
+      base += nodes;
+    }
+
+    // Every tile of every level
+    QVector<qkey> keys;
+    for (int level = 1; level <= numLevels; level++) {
+      for (qkey q = 1 << (2 * level); q < qkey(1) << (2 * level + 1); q++) {
+        keys << q;
+      }
+    }
+
+    QTime time;
+    time.start();
+    QVector<uint32_t> offsets;
+    prepareIndex(indexData, numLevels, offsets);
+    int buildTime = time.elapsed();
+
+    const int rounds = 20;
+    quint64 sum = 0;
+    time.restart();
+    for (int r = 0; r < rounds; r++) {
+      foreach (qkey q, keys) {
+        uint32_t offset, len;
+        walkIndexV1(indexData, q, offset, len);
+        sum += offset + len;
+      }
+    }
+    int walkTime = time.elapsed();
+
+    Entry e(0);
+    e.indexData = indexData;
+    e.tileOffsets = offsets;
+    quint64 tableSum = 0;
+    time.restart();
+    for (int r = 0; r < rounds; r++) {
+      foreach (qkey q, keys) {
+        uint32_t offset, len;
+        c.findTileRange(q, &e, offset, len);
+        tableSum += offset + len;
+      }
+    }
+    int tableTime = time.elapsed();
+
+    qDebug() << rounds * keys.size() << " lookups in a " << numLevels 
+             << " level index: walk " << walkTime << " ms, table " << tableTime
+             << " ms (built in " << buildTime << " ms)" 
+             << (sum == tableSum ? "" : "; RESULTS DIFFER");
+  }
+
+  qreal NetBench::diskLoads(Cache &c, int numObjects, 
+                           const QByteArray &data)
+  {
+    if (!c.objectDb) return 0.0;
+
+    // Tiles of one level, written straight to the disk cache
+    QList<Key> keys;
+    qkey base = qkey(1) << 20;
+    for (int i = 0; i < numObjects; i++) {
+      Key key = tileKey(0, base + i);
+      keys << key;
+      if (!c.cacheEntries.find(key)) {
+        Entry *e = c.newEntry(key);
+        e->state = Storing;
+        e->diskSize = data.size();
+        e->lastAccess = c.accessClock;
+        c.postIORequest(IORequest(SaveObject, key, data, e->lastAccess));
+      }
+    }
+    int i = 0;
+    while (i < keys.size()) {
+      Entry *e = c.cacheEntries.find(keys[i]);
+      if (e && e->state == Storing) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+      } else {
+        i++;
+      }
+    }
+
+    // Load them back, as requested tiles found on disk are
+    int loads = 0;
+    QTime time;
+    time.start();
+    foreach (Key key, keys) {
+      Entry *e = c.cacheEntries.find(key);
+      if (!e || e->state != Disk) continue;
+      c.removeFromDiskLRU(*e);
+      e->state = Loading;
+      c.diskLoading.push_back(*e);
+      c.postIORequest(IORequest(LoadObject, key, QVariant()));
+      loads++;
+    }
+    while (!c.diskLoading.empty()) {
+      QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    int elapsed = std::max(1, time.elapsed());
+    return loads * 1000.0 / elapsed;
+  }
+
+  void NetBench::writeSyntheticMetadata(Cache &c, int numObjects, 
+                                        uint32_t size)
+  {
+    if (!c.timestampDb) return;
+    qkey base = qkey(1) << 20;
+    for (int i = 0; i < numObjects; i++) {
+      Key key = tileKey(0, base + i);
+      uint32_t timeSize[2] = { uint32_t(i), size };
+      DBT dbKey, dbData;
+      memset(&dbKey, 0, sizeof(DBT));
+      memset(&dbData, 0, sizeof(DBT));
+      dbKey.data = &key;
+      dbKey.size = sizeof(Key);
+      dbData.data = &timeSize;
+      dbData.size = sizeof(timeSize);
+      int ret = c.timestampDb->put(c.timestampDb, NULL, &dbKey, &dbData, 0);
+      if (ret != 0) {
+        qWarning() << "Cache timestamp DB put failed with return code " << ret;
+        return;
+      }
+    }
+    // Later accesses must be newer than every record. The cache checkpoints
+    // the clock and the total size when it is destroyed, so the next cache
+    // opened on the directory starts as though it held the objects.
+    c.accessClock = std::max(c.accessClock, uint32_t(numObjects));
+    c.diskTotalSize = qint64(numObjects) * size;
+  }
+} // namespace Cache
+
+// Time loading n synthetic tiles from the disk cache with 1, 2, 4 and 8 IO
+// threads
+static void benchmarkDiskLoads(Map *map, QNetworkAccessManager &manager,
+                               const QString &cacheDir, int n, bool indexed)
+{
+  QByteArray png = syntheticTilePng(200);
+  QString dir = QDir(cacheDir).filePath("diskloads");
+  QDir::current().mkpath(dir);
+  int maxDisk = int(qint64(n) * png.size() / (1024 * 1024)) + 64;
+  printf("Loading %d tiles of %d bytes\n", n, png.size());
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    Cache::Cache tileCache(map, manager, 64, maxDisk, dir, threads);
+    tileCache.setIndexedTiles(indexed);
+    qreal rate = Cache::NetBench::diskLoads(tileCache, n, png);
+    printf("%d IO threads: %8.0f loads/s\n", threads, rate);
+  }
+}
+
+// Size of each object of a synthetic disk cache
+static const uint32_t syntheticObjectSize = 16384;
+
+// Time starting a cache that holds 10^4 objects, and ten times as many up to
+// n, and then reading the timestamps of all its objects, as startup did
+// before that was deferred
+static void benchmarkStartup(Map *map, QNetworkAccessManager &manager,
+                             const QString &cacheDir, int n)
+{
+  for (int objects = 10000; objects <= n; objects *= 10) {
+    QString dir = QDir(cacheDir).filePath(QString("startup-%1").arg(objects));
+    QDir::current().mkpath(dir);
+    int maxDisk = int(qint64(objects) * syntheticObjectSize / (1024 * 1024)) 
+      + 64;
+    {
+      Cache::Cache tileCache(map, manager, 64, maxDisk, dir, 1);
+      Cache::NetBench::writeSyntheticMetadata(tileCache, objects, 
+                                             syntheticObjectSize);
+    }
+
+    QTime time;
+    time.start();
+    Cache::Cache tileCache(map, manager, 64, maxDisk, dir);
+    int startTime = time.restart();
+    while (!tileCache.loadDiskIndexNow()) {
+      QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    int scanTime = time.elapsed();
+    printf("%8d objects: startup %6d ms, reading timestamps %6d ms\n",
+           objects, startTime, scanTime);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-m map] [-l layer] [-c cache dir] [-s WxH] "
+          "[-i step interval ms] [-t timeout s] [-f pixmap|indexed] "
+          "<base url> <script>\n"
+          "       %s [-m map] -q <requests>\n"
+          "       %s [-m map] -r <index levels>\n"
+          "       %s [-m map] [-c cache dir] [-f pixmap|indexed] -o <tiles>\n"
+          "       %s [-m map] [-c cache dir] -u <objects>\n"
+          "       %s -d <tiles>\n"
+          "       %s -k <tiles>\n"
+          "       %s -p <tiles>\n", name, name, name, name, name, name, name, 
+          name);
+  exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+  qRegisterMetaType<Cache::Key>("Key");
+  qRegisterMetaType<Tile>("Tile");
+  qRegisterMetaType<qkey>("qkey");
+
+  // Tiles are decoded into QPixmaps, so a display is needed; use Xvfb to run
+  // without one.
+  QApplication app(argc, argv);
+
+  QString mapId, layerName, cacheDir;
+  QSize viewSize(1024, 768);
+  int stepInterval = 40;
+  int timeout = 60;
+  int queueRequests = 0;
+  int indexLevels = 0;
+  int drawTiles = 0;
+  int kernelTiles = 0;
+  int decodeTiles = 0;
+  int diskTiles = 0;
+  int startupObjects = 0;
+  bool indexedTiles = false;
+  QStringList args = app.arguments();
+  int i = 1;
+  for (; i < args.size() && args[i].startsWith("-"); i += 2) {
+    if (i + 1 >= args.size()) usage(argv[0]);
+    QString opt = args[i], val = args[i + 1];
+    if (opt == "-m") mapId = val;
+    else if (opt == "-l") layerName = val;
+    else if (opt == "-c") cacheDir = val;
+    else if (opt == "-i") stepInterval = val.toInt();
+    else if (opt == "-t") timeout = val.toInt();
+    else if (opt == "-q") queueRequests = val.toInt();
+    else if (opt == "-r") indexLevels = val.toInt();
+    else if (opt == "-d") drawTiles = val.toInt();
+    else if (opt == "-k") kernelTiles = val.toInt();
+    else if (opt == "-p") decodeTiles = val.toInt();
+    else if (opt == "-o") diskTiles = val.toInt();
+    else if (opt == "-u") startupObjects = val.toInt();
+    else if (opt == "-f" && (val == "pixmap" || val == "indexed")) {
+      indexedTiles = val == "indexed";
+    }
+    else if (opt == "-s") {
+      QStringList wh = val.split("x");
+      if (wh.size() != 2) usage(argv[0]);
+      viewSize = QSize(wh[0].toInt(), wh[1].toInt());
+    }
+    else usage(argv[0]);
+  }
+  bool microBenchmark = queueRequests > 0 || indexLevels > 0 || 
+    diskTiles > 0 || startupObjects > 0;
+  bool imageBenchmark = drawTiles > 0 || kernelTiles > 0 || decodeTiles > 0;
+  if (args.size() - i != (microBenchmark || imageBenchmark ? 0 : 2)) {
+    usage(argv[0]);
+  }
+  if (imageBenchmark) {
+    if (drawTiles > 0) benchmarkTileDrawing(drawTiles);
+    if (kernelTiles > 0) benchmarkPixelKernels(kernelTiles);
+    if (decodeTiles > 0) benchmarkTileDecoding(decodeTiles);
+    return 0;
+  }
+
+  RootData rootData(NULL);
+  if (rootData.maps().size() == 0) {
+    qFatal("No maps in root data file!");
+  }
+  Map *map = mapId.isEmpty() ? rootData.maps().values()[0]
+    : rootData.maps().value(mapId);
+  if (!map) {
+    fprintf(stderr, "Unknown map %s\n", mapId.toLatin1().data());
+    return -1;
+  }
+
+  // Start from an empty cache unless told otherwise, so every tile comes
+  // from the network
+  if (cacheDir.isEmpty()) {
+    cacheDir = QDir::temp().filePath(QString("ztopo-netbench-%1")
+                                     .arg(app.applicationPid()));
+  }
+  QDir::current().mkpath(cacheDir);
+
+  QNetworkAccessManager networkManager;
+  if (microBenchmark) {
+    if (diskTiles > 0) {
+      benchmarkDiskLoads(map, networkManager, cacheDir, diskTiles, indexedTiles);
+    }
+    if (startupObjects > 0) {
+      benchmarkStartup(map, networkManager, cacheDir, startupObjects);
+    }
+    if (queueRequests > 0 || indexLevels > 0) {
+      Cache::Cache tileCache(map, networkManager, 64, 200, cacheDir);
+      if (queueRequests > 0) {
+        Cache::NetBench::networkQueue(tileCache, queueRequests);
+      }
+      if (indexLevels > 0) Cache::NetBench::tileRanges(tileCache, indexLevels);
+    }
+    return 0;
+  }
+
+  QUrl baseUrl(args[i]);
+  QString scriptName(args[i + 1]);
+  map->setBaseUrl(baseUrl);
+
+  int layer = -1;
+  if (!layerName.isEmpty() && !map->layerById(layerName, layer)) {
+    fprintf(stderr, "Unknown layer %s\n", layerName.toLatin1().data());
+    return -1;
+  }
+
+  QFile script(scriptName);
+  if (!script.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    fprintf(stderr, "Cannot open script %s\n", scriptName.toLatin1().data());
+    return -1;
+  }
+
+  {
+    Cache::Cache tileCache(map, networkManager, 64, 200, cacheDir);
+    tileCache.setIndexedTiles(indexedTiles);
+    MapRenderer renderer(map, tileCache);
+    BenchClient client(map, layer);
+    client.viewSize = viewSize;
+    client.center = QPoint(0, 0);
+    client.scale = 1.0;
+    renderer.addClient(&client);
+
+    int totalTime = 0, lines = 0;
+    bool timedOut = false;
+    QTextStream in(&script);
+    while (!in.atEnd() && !timedOut) {
+      QString line = in.readLine().trimmed();
+      QStringList f = line.split(' ', QString::SkipEmptyParts);
+      if (f.isEmpty() || f[0].startsWith("#")) continue;
+
+      QPoint start = client.center;
+      qreal startScale = client.scale;
+      int steps = 1;
+      QPoint delta;
+      qreal factor = 1.0;
+      if (f[0] == "view" && f.size() == 4) {
+        client.center = QPoint(f[1].toInt(), f[2].toInt());
+        client.scale = startScale = f[3].toDouble();
+        start = client.center;
+      } else if (f[0] == "pan" && f.size() == 4) {
+        delta = QPoint(f[1].toInt(), f[2].toInt());
+        steps = std::max(1, f[3].toInt());
+      } else if (f[0] == "zoom" && f.size() == 3) {
+        factor = f[1].toDouble();
+        steps = std::max(1, f[2].toInt());
+      } else {
+        fprintf(stderr, "Bad script line: %s\n", line.toLatin1().data());
+        return -1;
+      }
+
+      unsigned int reqs = tileCache.getNetworkRequests();
+      unsigned int bundles = tileCache.getNetworkBundles();
+      unsigned int bytes = tileCache.getNetworkBytes();
+      QTime time;
+      time.start();
+      for (int s = 1; s <= steps; s++) {
+        client.scale = startScale * pow(factor, qreal(s) / steps);
+        client.center = start + (delta * s / steps) / client.scale;
+        renderer.loadTiles(client.layer(), client.visibleArea(), client.scale);
+        if (s < steps) runEvents(NULL, stepInterval);
+      }
+      while (!renderer.loadTiles(client.layer(), client.visibleArea(),
+                                 client.scale)) {
+        if (time.elapsed() > timeout * 1000) {
+          timedOut = true;
+          break;
+        }
+        runEvents(&tileCache, pollInterval);
+      }
+      int elapsed = time.elapsed();
+      totalTime += elapsed;
+      lines++;
+
+      reqs = tileCache.getNetworkRequests() - reqs;
+      bundles = tileCache.getNetworkBundles() - bundles;
+      bytes = tileCache.getNetworkBytes() - bytes;
+      printf("%-32s %6d ms%s %5u reqs %4u bundles %9u bytes (%.1f reqs per bundle)\n",
+             line.toLatin1().data(), elapsed, timedOut ? " (timed out)" : "",
+             reqs, bundles, bytes, bundles ? qreal(reqs) / qreal(bundles) : 0.0);
+    }
+
+    unsigned int reqs = tileCache.getNetworkRequests();
+    unsigned int bundles = tileCache.getNetworkBundles();
+    printf("Total: %d viewports in %d ms (%.1f ms per viewport); %u reqs in "
+           "%u bundles (%.1f reqs per bundle), %u bytes\n",
+           lines, totalTime, lines ? qreal(totalTime) / lines : 0.0, reqs, bundles,
+           bundles ? qreal(reqs) / qreal(bundles) : 0.0,
+           tileCache.getNetworkBytes());
+    renderer.removeClient(&client);
+
+    // The cache reports its detailed statistics when destroyed
+  }
+  return 0;
+}
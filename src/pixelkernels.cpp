@@ -0,0 +1,457 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <climits>
+#include <cstdlib>
+#include "pixelkernels.h"
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || \
+  defined(_M_X64)
+#define PIXEL_KERNELS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC compiles the SIMD versions for their instruction sets function by 
+// function, so the rest of the program need not require them
+#if defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+// Size of the cache of nearest palette entries used when quantizing; a 
+// power of 2
+static const int quantizeCacheSize = 4096;
+
+// Scalar versions
+
+static void expandPaletteScalar(const uchar *src, QRgb *dst, int n, 
+                                const QRgb *palette)
+{
+  for (int i = 0; i < n; i++) {
+    dst[i] = palette[src[i]];
+  }
+}
+
+static inline int colorDistance(QRgb a, QRgb b)
+{
+  return abs(qRed(a) - qRed(b)) + abs(qGreen(a) - qGreen(b)) + 
+    abs(qBlue(a) - qBlue(b)) + abs(qAlpha(a) - qAlpha(b));
+}
+
+static int nearestColorScalar(QRgb pixel, const QRgb *palette, int size)
+{
+  int best = 0, bestDistance = INT_MAX;
+  for (int i = 0; i < size; i++) {
+    int d = colorDistance(pixel, palette[i]);
+    if (d < bestDistance) {
+      bestDistance = d;
+      best = i;
+    }
+  }
+  return best;
+}
+
+static inline QRgb average4(QRgb a, QRgb b, QRgb c, QRgb d)
+{
+  QRgb r = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint sum = ((a >> shift) & 0xff) + ((b >> shift) & 0xff) + 
+      ((c >> shift) & 0xff) + ((d >> shift) & 0xff);
+    r |= ((sum + 2) >> 2) << shift;
+  }
+  return r;
+}
+
+static void downsampleRowsScalar(const QRgb *row0, const QRgb *row1, QRgb *dst,
+                                 int n)
+{
+  for (int i = 0; i < n; i++) {
+    dst[i] = average4(row0[2 * i], row0[2 * i + 1], row1[2 * i], 
+                      row1[2 * i + 1]);
+  }
+}
+
+static const PixelKernels scalarKernels = {
+  "scalar", expandPaletteScalar, nearestColorScalar, downsampleRowsScalar
+};
+
+
+#ifdef PIXEL_KERNELS_X86
+
+// Pick the nearest of several candidates, given their distances; the lowest 
+// index wins a tie
+static inline int pickNearest(const int *distance, const int *index, int n, 
+                              int &bestDistance)
+{
+  int best = 0;
+  bestDistance = INT_MAX;
+  for (int i = 0; i < n; i++) {
+    if (distance[i] < bestDistance || 
+        (distance[i] == bestDistance && index[i] < best)) {
+      bestDistance = distance[i];
+      best = index[i];
+    }
+  }
+  return best;
+}
+
+// SSE2 versions. SSE2 has no gather, so palette expansion is only unrolled.
+
+TARGET_SSE2
+static void expandPaletteSSE2(const uchar *src, QRgb *dst, int n, 
+                              const QRgb *palette)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_setr_epi32(palette[src[i]], palette[src[i + 1]],
+                               palette[src[i + 2]], palette[src[i + 3]]);
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+  for (; i < n; i++) {
+    dst[i] = palette[src[i]];
+  }
+}
+
+// Sums of the absolute differences of the bytes of each 32-bit lane
+TARGET_SSE2
+static inline __m128i laneDistanceSSE2(__m128i a, __m128i b)
+{
+  __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+  __m128i pairs = _mm_add_epi16(_mm_and_si128(d, _mm_set1_epi16(0xff)),
+                                _mm_srli_epi16(d, 8));
+  return _mm_madd_epi16(pairs, _mm_set1_epi16(1));
+}
+
+TARGET_SSE2
+static int nearestColorSSE2(QRgb pixel, const QRgb *palette, int size)
+{
+  __m128i p = _mm_set1_epi32(pixel);
+  __m128i best = _mm_set1_epi32(INT_MAX), bestIndex = _mm_setzero_si128();
+  __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+  int i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m128i d = laneDistanceSSE2(p, _mm_loadu_si128((const __m128i *)(palette + i)));
+    __m128i less = _mm_cmplt_epi32(d, best);
+    best = _mm_or_si128(_mm_and_si128(less, d), _mm_andnot_si128(less, best));
+    bestIndex = _mm_or_si128(_mm_and_si128(less, index), 
+                             _mm_andnot_si128(less, bestIndex));
+    index = _mm_add_epi32(index, _mm_set1_epi32(4));
+  }
+
+  int distance[5], indices[5];
+  _mm_storeu_si128((__m128i *)distance, best);
+  _mm_storeu_si128((__m128i *)indices, bestIndex);
+  int bestDistance;
+  int nearest = pickNearest(distance, indices, 4, bestDistance);
+  for (; i < size; i++) {
+    int d = colorDistance(pixel, palette[i]);
+    if (d < bestDistance) {
+      bestDistance = d;
+      nearest = i;
+    }
+  }
+  return nearest;
+}
+
+// Sum two rows of 4 pixels each into 16-bit channels, and add horizontal
+// pairs: the result holds the 2x2 sums of the two blocks
+TARGET_SSE2
+static inline __m128i blockSumsSSE2(__m128i a, __m128i b)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), 
+                             _mm_unpacklo_epi8(b, zero));
+  __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), 
+                             _mm_unpackhi_epi8(b, zero));
+  lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+  hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+  return _mm_unpacklo_epi64(lo, hi);
+}
+
+TARGET_SSE2
+static void downsampleRowsSSE2(const QRgb *row0, const QRgb *row1, QRgb *dst,
+                               int n)
+{
+  __m128i two = _mm_set1_epi16(2);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m128i *a = (const __m128i *)(row0 + 2 * i);
+    const __m128i *b = (const __m128i *)(row1 + 2 * i);
+    __m128i s0 = blockSumsSSE2(_mm_loadu_si128(a), _mm_loadu_si128(b));
+    __m128i s1 = blockSumsSSE2(_mm_loadu_si128(a + 1), _mm_loadu_si128(b + 1));
+    s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+    s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(s0, s1));
+  }
+  downsampleRowsScalar(row0 + 2 * i, row1 + 2 * i, dst + i, n - i);
+}
+
+static const PixelKernels sse2Kernels = {
+  "SSE2", expandPaletteSSE2, nearestColorSSE2, downsampleRowsSSE2
+};
+
+
+// AVX2 versions
+
+TARGET_AVX2
+static void expandPaletteAVX2(const uchar *src, QRgb *dst, int n, 
+                              const QRgb *palette)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+    __m256i v = _mm256_i32gather_epi32((const int *)palette, index, 4);
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+  expandPaletteScalar(src + i, dst + i, n - i, palette);
+}
+
+TARGET_AVX2
+static int nearestColorAVX2(QRgb pixel, const QRgb *palette, int size)
+{
+  __m256i p = _mm256_set1_epi32(pixel);
+  __m256i best = _mm256_set1_epi32(INT_MAX), bestIndex = _mm256_setzero_si256();
+  __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  int i = 0;
+  for (; i + 8 <= size; i += 8) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(palette + i));
+    __m256i d = _mm256_or_si256(_mm256_subs_epu8(p, c), _mm256_subs_epu8(c, p));
+    // Sums of the 4 bytes of each lane
+    d = _mm256_madd_epi16(_mm256_maddubs_epi16(d, _mm256_set1_epi8(1)), 
+                          _mm256_set1_epi16(1));
+    __m256i less = _mm256_cmpgt_epi32(best, d);
+    best = _mm256_blendv_epi8(best, d, less);
+    bestIndex = _mm256_blendv_epi8(bestIndex, index, less);
+    index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+  }
+
+  int distance[8], indices[8];
+  _mm256_storeu_si256((__m256i *)distance, best);
+  _mm256_storeu_si256((__m256i *)indices, bestIndex);
+  int bestDistance;
+  int nearest = pickNearest(distance, indices, 8, bestDistance);
+  for (; i < size; i++) {
+    int d = colorDistance(pixel, palette[i]);
+    if (d < bestDistance) {
+      bestDistance = d;
+      nearest = i;
+    }
+  }
+  return nearest;
+}
+
+TARGET_AVX2
+static inline __m256i blockSumsAVX2(__m256i a, __m256i b)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), 
+                                _mm256_unpacklo_epi8(b, zero));
+  __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), 
+                                _mm256_unpackhi_epi8(b, zero));
+  lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+  hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+  return _mm256_unpacklo_epi64(lo, hi);
+}
+
+TARGET_AVX2
+static void downsampleRowsAVX2(const QRgb *row0, const QRgb *row1, QRgb *dst,
+                               int n)
+{
+  __m256i two = _mm256_set1_epi16(2);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i *a = (const __m256i *)(row0 + 2 * i);
+    const __m256i *b = (const __m256i *)(row1 + 2 * i);
+    __m256i s0 = blockSumsAVX2(_mm256_loadu_si256(a), _mm256_loadu_si256(b));
+    __m256i s1 = blockSumsAVX2(_mm256_loadu_si256(a + 1), 
+                               _mm256_loadu_si256(b + 1));
+    s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, two), 2);
+    s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, two), 2);
+    // Packing works within 128-bit lanes, leaving the blocks out of order
+    __m256i v = _mm256_packus_epi16(s0, s1);
+    v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+  downsampleRowsSSE2(row0 + 2 * i, row1 + 2 * i, dst + i, n - i);
+}
+
+static const PixelKernels avx2Kernels = {
+  "AVX2", expandPaletteAVX2, nearestColorAVX2, downsampleRowsAVX2
+};
+
+static bool cpuHasSSE2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+  return true;
+#elif defined(__GNUC__)
+  return __builtin_cpu_supports("sse2");
+#else
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+#endif
+}
+
+static bool cpuHasAVX2()
+{
+#if defined(__GNUC__)
+  return __builtin_cpu_supports("avx2");
+#else
+  // AVX2 needs the processor's support and the operating system's, to save
+  // the 256-bit registers
+  int info[4];
+  __cpuid(info, 1);
+  bool osSaves = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+  __cpuidex(info, 7, 0);
+  return osSaves && (info[1] & (1 << 5)) != 0;
+#endif
+}
+
+#endif // PIXEL_KERNELS_X86
+
+
+QList<const PixelKernels *> supportedPixelKernels()
+{
+  QList<const PixelKernels *> kernels;
+  kernels << &scalarKernels;
+#ifdef PIXEL_KERNELS_X86
+  if (cpuHasSSE2()) {
+    kernels << &sse2Kernels;
+    if (cpuHasAVX2()) {
+      kernels << &avx2Kernels;
+    }
+  }
+#endif
+  return kernels;
+}
+
+const PixelKernels &pixelKernels()
+{
+  static const PixelKernels *kernels = supportedPixelKernels().last();
+  return *kernels;
+}
+
+
+// The color table of an indexed image, padded to 256 entries and
+// premultiplied if it has any transparency. Returns true if it does.
+static bool expansionPalette(const QImage &image, QRgb *palette)
+{
+  QVector<QRgb> colors = image.colorTable();
+  bool alpha = false;
+  for (int i = 0; i < 256; i++) {
+    QRgb c = i < colors.size() ? colors[i] : 0xff000000;
+    if (qAlpha(c) != 0xff) {
+      alpha = true;
+    }
+    palette[i] = c;
+  }
+  for (int i = 0; alpha && i < 256; i++) {
+    QRgb c = palette[i];
+    int a = qAlpha(c);
+    palette[i] = qRgba(qRed(c) * a / 255, qGreen(c) * a / 255, 
+                       qBlue(c) * a / 255, a);
+  }
+  return alpha;
+}
+
+QImage expandIndexedImage(const QImage &image)
+{
+  if (image.format() != QImage::Format_Indexed8) {
+    return image;
+  }
+  QRgb palette[256];
+  bool alpha = expansionPalette(image, palette);
+  QImage out(image.size(), alpha ? QImage::Format_ARGB32_Premultiplied 
+             : QImage::Format_RGB32);
+  const PixelKernels &k = pixelKernels();
+  for (int y = 0; y < image.height(); y++) {
+    k.expandPalette(image.scanLine(y), (QRgb *)out.scanLine(y), image.width(),
+                    palette);
+  }
+  return out;
+}
+
+void downsampleImage(const QImage &image, QImage &dst, int x, int y)
+{
+  const PixelKernels &k = pixelKernels();
+  int w = image.width() / 2, h = image.height() / 2;
+
+  if (image.format() == QImage::Format_Indexed8) {
+    QRgb palette[256];
+    expansionPalette(image, palette);
+    QVector<QRgb> rows(4 * w);
+    for (int j = 0; j < h; j++) {
+      k.expandPalette(image.scanLine(2 * j), rows.data(), 2 * w, palette);
+      k.expandPalette(image.scanLine(2 * j + 1), rows.data() + 2 * w, 2 * w,
+                      palette);
+      k.downsampleRows(rows.data(), rows.data() + 2 * w, 
+                       (QRgb *)dst.scanLine(y + j) + x, w);
+    }
+    return;
+  }
+
+  QImage src = image;
+  if (src.format() != QImage::Format_RGB32 && 
+      src.format() != QImage::Format_ARGB32_Premultiplied) {
+    src = src.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+  }
+  for (int j = 0; j < h; j++) {
+    k.downsampleRows((const QRgb *)src.scanLine(2 * j), 
+                     (const QRgb *)src.scanLine(2 * j + 1),
+                     (QRgb *)dst.scanLine(y + j) + x, w);
+  }
+}
+
+QImage quantizeImage(const QImage &image, const QVector<QRgb> &palette)
+{
+  QImage src = image;
+  if (src.format() != QImage::Format_RGB32 && 
+      src.format() != QImage::Format_ARGB32) {
+    src = src.convertToFormat(QImage::Format_ARGB32);
+  }
+  QImage out(src.size(), QImage::Format_Indexed8);
+  out.setColorTable(palette);
+
+  // Tiles have few distinct colors, so most searches are answered from a
+  // cache indexed by a hash of the color
+  QVector<QRgb> cacheColors(quantizeCacheSize);
+  QVector<int> cacheIndices(quantizeCacheSize, -1);
+  const PixelKernels &k = pixelKernels();
+  for (int y = 0; y < src.height(); y++) {
+    const QRgb *in = (const QRgb *)src.scanLine(y);
+    uchar *line = out.scanLine(y);
+    for (int x = 0; x < src.width(); x++) {
+      QRgb c = in[x];
+      int slot = ((c * 0x9e3779b1u) >> 20) & (quantizeCacheSize - 1);
+      if (cacheIndices[slot] < 0 || cacheColors[slot] != c) {
+        cacheColors[slot] = c;
+        cacheIndices[slot] = k.nearestColor(c, palette.constData(), 
+                                            palette.size());
+      }
+      line[x] = uchar(cacheIndices[slot]);
+    }
+  }
+  return out;
+}
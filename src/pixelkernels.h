@@ -0,0 +1,68 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef PIXELKERNELS_H
+#define PIXELKERNELS_H 1
+
+#include <QColor>
+#include <QImage>
+#include <QList>
+#include <QVector>
+
+// Inner loops over tile pixels. Each has a scalar version and, on x86, SSE2
+// and AVX2 versions; all give identical results. The fastest version the
+// processor supports is chosen when first used.
+struct PixelKernels {
+  const char *name;
+
+  // dst[i] = palette[src[i]] for n pixels
+  void (*expandPalette)(const uchar *src, QRgb *dst, int n, const QRgb *palette);
+
+  // Index of the palette entry nearest a pixel, by the sum of the absolute
+  // differences of its channels; the first such entry if there are several.
+  // This is the match QImage::convertToFormat makes against a color table.
+  int (*nearestColor)(QRgb pixel, const QRgb *palette, int paletteSize);
+
+  // Average each 2x2 block of two rows of 2 * n pixels into n pixels, 
+  // rounding to nearest
+  void (*downsampleRows)(const QRgb *row0, const QRgb *row1, QRgb *dst, int n);
+};
+
+// The kernel versions this processor supports, slowest first
+QList<const PixelKernels *> supportedPixelKernels();
+
+// The version in use
+const PixelKernels &pixelKernels();
+
+// Expand an 8-bit indexed image to Format_RGB32, or to 
+// Format_ARGB32_Premultiplied if its color table has any transparency. 
+// Other images are returned unchanged.
+QImage expandIndexedImage(const QImage &image);
+
+// Halve an image with a 2x2 box filter, into a w x h rectangle of dst at
+// (x, y); the image must be 2w x 2h. Indexed images are expanded on the fly.
+// dst must be Format_RGB32 or Format_ARGB32_Premultiplied.
+void downsampleImage(const QImage &image, QImage &dst, int x, int y);
+
+// Convert a 32-bit image to an 8-bit indexed image with the given color 
+// table, taking the nearest color for each pixel. Gives the same result as
+// QImage::convertToFormat with a color table.
+QImage quantizeImage(const QImage &image, const QVector<QRgb> &palette);
+
+#endif
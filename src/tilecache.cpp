@@ -17,6 +17,9 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <algorithm>
+#include <cstdlib>
+#include <new>
 #include <stdint.h>
 #include <QCoreApplication>
 #include <QDebug>
@@ -24,23 +27,67 @@
 #include <QNetworkReply>
 #include <QNetworkRequest>
 #include <QStringBuilder>
+#include <QTime>
 #include <db.h>
 #include "tilecache.h"
+#include "tileindex.h"
 #include "consts.h"
+#include "pixelkernels.h"
 
 using namespace boost::intrusive;
 
-static const int numWorkerThreads = 1;
-static const int maxThreadWaitTime = 1000; // Maximum time to wait for a thread to die
 
 static const int maxBufferSize = 500000;
 
-// Maximum number of network requests in flight simultaneously
-static const int maxNetworkRequestsInFlight = 6;
+// Most distinct color tables for indexed tiles to share
+static const int maxSharedPalettes = 16;
+
+// Bounds on the number of network requests in flight simultaneously. The
+// window between them is adjusted as requests complete.
+static const qreal minNetworkWindow = 1.0;
+static const qreal maxNetworkWindow = 32.0;
+static const qreal initialNetworkWindow = 6.0;
+
+// A time to first byte this many times the baseline means requests are
+// queueing somewhere, so the window shrinks
+static const qreal congestedLatencyFactor = 2.0;
+static const qreal networkWindowDecrease = 0.75;
+
+// Bounds on the length of a bundle of network requests, in bytes
+static const uint32_t minBundleCap = 64 * 1024;
+static const uint32_t maxBundleCap = 4 * 1024 * 1024;
+
+// Most byte ranges to ask for in one request
+static const int maxRangesPerRequest = 32;
+
+// Approximate size of the headers of each part of a multipart/byteranges
+// reply; gaps shorter than this are cheaper to fetch than to skip
+static const uint32_t multipartOverhead = 128;
+
+// A bundle may take this many round trip times to transfer
+static const int bundleRoundTrips = 4;
+
+// Initial estimates of network performance, refined as requests complete
+static const qreal initialNetworkLatency = 100.0;   // ms
+static const qreal initialNetworkBandwidth = 256.0; // bytes per ms
+
+// Interval between checkpoints of object access times, in ms
+static const int checkpointInterval = 30000;
+
+// Number of dirty access times that forces an early checkpoint
+static const int maxDirtyMetadata = 4096;
+
+// Timestamp database key under which the access clock and the total size of
+// the disk cache (in KB) are saved. No object has key 0, since quad keys
+// always have a leading 1 bit.
+static const Cache::Key clockRecordKey = 0;
 
 namespace Cache {
   typedef QPair<Key, uint32_t> NetworkReqKey;
 
+  // Stands in for unrequested bytes between the objects of a bundle
+  static const Key gapKey = ~Key(0);
+
   static const int kindShift = 56;
   static const int layerShift = 48;
   Kind keyKind(Key k) {
@@ -66,19 +113,241 @@ namespace Cache {
   
   Entry::Entry(Key aKey) 
     : key(aKey), pixmap(NULL), indexData(NULL), memSize(0), diskSize(0),
+      lastAccess(0), useCount(0), isProtected(false), isPrefetch(false), 
       state(Invalid), inUse(false)
   {
   }
   
-  IORequest::IORequest(IORequestKind k, Key t, QVariant d)
-    : kind(k), tile(t), data(d)
+  MemoryPolicy *MemoryPolicy::create(MemoryPolicyKind kind)
+  {
+    switch (kind) {
+    case LRUPolicyKind: return new LRUMemoryPolicy();
+    case SegmentedLRUPolicyKind: return new SegmentedLRUMemoryPolicy();
+    default: qFatal("Unknown memory policy kind");
+    }
+    return NULL; // Shut up gcc warning
+  }
+
+  void LRUMemoryPolicy::add(Entry &e)
+  {
+    lru.push_back(e);
+  }
+
+  void LRUMemoryPolicy::remove(Entry &e)
+  {
+    e.unlink();
+  }
+
+  Entry *LRUMemoryPolicy::evict()
+  {
+    if (lru.empty()) return NULL;
+    Entry &e = lru.front();
+    lru.pop_front();
+    return &e;
+  }
+
+  // Largest fraction of the policy's objects, by size, that may be protected
+  static const qreal maxProtectedFraction = 0.8;
+
+  SegmentedLRUMemoryPolicy::SegmentedLRUMemoryPolicy()
+    : probationSize(0), protectedSize(0)
+  {
+  }
+
+  void SegmentedLRUMemoryPolicy::add(Entry &e)
+  {
+    if (e.useCount <= 1) {
+      e.isProtected = false;
+      probationSize += e.memSize;
+      probation.push_back(e);
+      return;
+    }
+
+    e.isProtected = true;
+    protectedSize += e.memSize;
+    protectedSegment.push_back(e);
+
+    // Demote the least recently used protected objects if the protected
+    // segment has grown too large.
+    while (protectedSize > maxProtectedFraction * (protectedSize + probationSize)
+           && !protectedSegment.empty()) {
+      Entry &d = protectedSegment.front();
+      protectedSegment.pop_front();
+      protectedSize -= d.memSize;
+      d.isProtected = false;
+      probationSize += d.memSize;
+      probation.push_back(d);
+    }
+  }
+
+  void SegmentedLRUMemoryPolicy::remove(Entry &e)
+  {
+    if (e.isProtected) {
+      protectedSize -= e.memSize;
+    } else {
+      probationSize -= e.memSize;
+    }
+    e.isProtected = false;
+    e.unlink();
+  }
+
+  Entry *SegmentedLRUMemoryPolicy::evict()
+  {
+    CacheList &segment = probation.empty() ? protectedSegment : probation;
+    if (segment.empty()) return NULL;
+    Entry &e = segment.front();
+    remove(e);
+    return &e;
+  }
+
+  // Number of entries allocated at a time by the entry pool
+  static const int entryPoolChunkSize = 1024;
+
+  EntryPool::EntryPool()
+    : freeList(NULL)
+  {
+  }
+
+  EntryPool::~EntryPool()
+  {
+    foreach (Slot *chunk, chunks) {
+      delete[] chunk;
+    }
+  }
+
+  Entry *EntryPool::allocate(Key key)
+  {
+    if (!freeList) {
+      Slot *chunk = new Slot[entryPoolChunkSize];
+      chunks << chunk;
+      for (int i = 0; i < entryPoolChunkSize; i++) {
+        chunk[i].next = freeList;
+        freeList = &chunk[i];
+      }
+    }
+    Slot *slot = freeList;
+    freeList = slot->next;
+    return new (slot->storage) Entry(key);
+  }
+
+  void EntryPool::release(Entry *e)
+  {
+    e->~Entry();
+    Slot *slot = (Slot *)e;
+    slot->next = freeList;
+    freeList = slot;
+  }
+
+  static const int minEntryTableCapacity = 1024;
+
+  EntryTable::EntryTable()
+    : buckets(NULL), capacity(0), shift(64), count(0)
+  {
+    resize(minEntryTableCapacity);
+  }
+
+  EntryTable::~EntryTable()
+  {
+    delete[] buckets;
+  }
+
+  int EntryTable::home(Key key) const
+  {
+    // Fibonacci hashing; the high bits of the product mix all the key bits
+    return int((key * 0x9E3779B97F4A7C15ULL) >> shift);
+  }
+
+  Entry *EntryTable::find(Key key) const
+  {
+    int mask = capacity - 1;
+    for (int i = home(key); buckets[i].entry; i = (i + 1) & mask) {
+      if (buckets[i].key == key) return buckets[i].entry;
+    }
+    return NULL;
+  }
+
+  void EntryTable::insert(Entry *e)
+  {
+    // Keep the load factor at most 1/2 so probe sequences stay short
+    if (2 * (count + 1) > capacity) {
+      resize(capacity * 2);
+    }
+    int mask = capacity - 1;
+    int i = home(e->key);
+    while (buckets[i].entry) {
+      assert(buckets[i].key != e->key);
+      i = (i + 1) & mask;
+    }
+    buckets[i].key = e->key;
+    buckets[i].entry = e;
+    count++;
+  }
+
+  void EntryTable::remove(Key key)
+  {
+    int mask = capacity - 1;
+    int i = home(key);
+    while (buckets[i].entry && buckets[i].key != key) {
+      i = (i + 1) & mask;
+    }
+    if (!buckets[i].entry) return;
+    buckets[i].entry = NULL;
+    count--;
+
+    // Shift back any following entries whose probe sequence passes through
+    // the bucket we just emptied, so lookups never need tombstones.
+    for (int j = (i + 1) & mask; buckets[j].entry; j = (j + 1) & mask) {
+      int k = home(buckets[j].key);
+      bool reachable = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+      if (!reachable) {
+        buckets[i] = buckets[j];
+        buckets[j].entry = NULL;
+        i = j;
+      }
+    }
+  }
+
+  QVector<Entry *> EntryTable::entries() const
+  {
+    QVector<Entry *> v;
+    v.reserve(count);
+    for (int i = 0; i < capacity; i++) {
+      if (buckets[i].entry) v << buckets[i].entry;
+    }
+    return v;
+  }
+
+  void EntryTable::resize(int newCapacity)
+  {
+    Bucket *old = buckets;
+    int oldCapacity = capacity;
+
+    buckets = new Bucket[newCapacity];
+    for (int i = 0; i < newCapacity; i++) {
+      buckets[i].entry = NULL;
+    }
+    capacity = newCapacity;
+    shift = 64 - (log2_int(newCapacity) - 1);
+    count = 0;
+
+    for (int i = 0; i < oldCapacity; i++) {
+      if (old[i].entry) insert(old[i].entry);
+    }
+    delete[] old;
+  }
+
+  IORequest::IORequest(IORequestKind k, Key t, QVariant d, uint32_t c)
+    : kind(k), tile(t), data(d), clock(c)
   {
   }
 
 
   NetworkRequestBundle::NetworkRequestBundle(Cache *c, Map *m, qkey index, 
                          uint32_t off, Key key, uint32_t len, QObject *parent)
-    : QObject(parent), cache(c), map(m), qidx(index), fOffset(off)
+    : QObject(parent), cache(c), map(m), qidx(index), fOffset(off), 
+      fPriority(0xffffffff), fSequence(c->networkSequence++), reply(NULL), 
+      latency(-1), parserStarted(false), parserOk(false), nextReq(0), 
+      nextPos(0), bytesReceived(0)
   {
     fLayer = keyLayer(key);
     fKind = keyKind(key);
@@ -104,22 +373,150 @@ namespace Cache {
     return len;
   }
 
+  int NetworkRequestBundle::numRequests() const
+  {
+    int n = 0;
+    foreach (const NetworkReqKey &req, reqs) {
+      if (req.first != gapKey) n++;
+    }
+    return n;
+  }
+
+  uint32_t NetworkRequestBundle::gapLength() const
+  {
+    uint32_t len = 0;
+    foreach (const NetworkReqKey &req, reqs) {
+      if (req.first == gapKey) len += req.second;
+    }
+    return len;
+  }
+
+  void NetworkRequestBundle::updatePriority()
+  {
+    fPriority = 0xffffffff;
+    foreach (const NetworkReqKey &req, reqs) {
+      if (req.first != gapKey) {
+        fPriority = qMin(fPriority, cache->networkPriority(req.first));
+      }
+    }
+  }
+
   bool NetworkRequestBundle::mergeBundle(NetworkRequestBundle *other)
   {
     assert(other != NULL);
     if (qidx != other->qidx || fLayer != other->fLayer || fKind != other->fKind)
       return false;
-    
-    if (offset() + length() == other->offset()) {
-      reqs.append(other->reqs);
-      return true;
-    } else if (other->offset() + other->length() == offset()) {
-      fOffset = other->offset();
-      reqs = other->reqs + reqs;
-      return true;
+
+    NetworkRequestBundle *first = this, *second = other;
+    if (other->offset() < offset()) {
+      std::swap(first, second);
+    }
+    uint32_t end = first->offset() + first->length();
+    if (end > second->offset()) {
+      return false;
+    }
+    uint32_t gap = second->offset() - end;
+    uint32_t total = second->offset() + second->length() - first->offset();
+    uint32_t gapCost;
+    if (cache->multiRangeRequests && fKind == TileKind) {
+      // Gaps are left out of the request, so only the wanted bytes count
+      uint32_t wanted = total - gap - first->gapLength() - second->gapLength();
+      if (wanted > cache->maxBundleLength() ||
+          first->byteRanges().size() + second->byteRanges().size() > 
+          maxRangesPerRequest) {
+        return false;
+      }
+      gapCost = qMin(gap, multipartOverhead);
+    } else {
+      if (gap > cache->maxBundleGap() || total > cache->maxBundleLength()) {
+        return false;
+      }
+      gapCost = gap;
     }
 
-    return false;
+    QList<NetworkReqKey> merged = first->reqs;
+    if (gap > 0) {
+      merged << NetworkReqKey(gapKey, gap);
+      cache->numGapMerges++;
+      cache->gapMergeSavings += 
+        qint64(cache->networkLatency * cache->networkBandwidth) - gapCost;
+    }
+    merged.append(second->reqs);
+    fOffset = first->offset();
+    reqs = merged;
+    fPriority = qMin(fPriority, other->fPriority);
+    fSequence = qMin(fSequence, other->fSequence);
+    return true;
+  }
+
+  NetworkRequestBundle *NetworkRequestBundle::trim(uint32_t &dropped)
+  {
+    dropped = 0;
+
+    // Objects nobody wants any more become gaps
+    for (int i = 0; i < reqs.size(); i++) {
+      Key key = reqs[i].first;
+      if (key != gapKey && !cache->isWantedFromNetwork(key)) {
+        cache->dropNetworkRequest(key);
+        reqs[i].first = gapKey;
+      }
+    }
+
+    // Drop gaps from the front
+    while (!reqs.isEmpty() && reqs.first().first == gapKey) {
+      fOffset += reqs.first().second;
+      dropped += reqs.first().second;
+      reqs.removeFirst();
+    }
+
+    // Find the first run of gaps that is too long to keep, or that ends the
+    // bundle. Gaps are not fetched in multiple range requests, so only the
+    // final one matters then.
+    uint32_t maxGap = (cache->multiRangeRequests && fKind == TileKind) ? 
+      0xffffffff : cache->maxBundleGap();
+    int i = 0;
+    uint32_t off = fOffset;
+    while (i < reqs.size()) {
+      if (reqs[i].first != gapKey) {
+        off += reqs[i].second;
+        i++;
+        continue;
+      }
+      int j = i;
+      uint32_t gap = 0;
+      while (j < reqs.size() && reqs[j].first == gapKey) {
+        gap += reqs[j].second;
+        j++;
+      }
+      if (j == reqs.size() || gap > maxGap) {
+        break;
+      }
+      off += gap;
+      i = j;
+    }
+    if (i == reqs.size()) {
+      return NULL;
+    }
+
+    // Drop the gap, and move whatever follows it into a new bundle
+    QList<NetworkReqKey> rest = reqs.mid(i);
+    reqs = reqs.mid(0, i);
+    int j = 0;
+    while (j < rest.size() && rest[j].first == gapKey) {
+      off += rest[j].second;
+      dropped += rest[j].second;
+      j++;
+    }
+    if (j == rest.size()) {
+      return NULL;
+    }
+    NetworkRequestBundle *b = new NetworkRequestBundle(cache, map, qidx, off, 
+                                                       rest[j].first, 
+                                                       rest[j].second, parent());
+    b->reqs = rest.mid(j);
+    b->fSequence = fSequence;
+    b->updatePriority();
+    return b;
   }
 
   void NetworkRequestBundle::makeRequests(QNetworkAccessManager *manager)
@@ -133,80 +530,329 @@ namespace Cache {
     req.setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute, true);
 
     // qDebug() << "req " << url << " off " << n.offset << " len "<< offset - n.offset << " coalesce " << bundle->size();
-    if (length() >= 0) {
-      QString rangeHdr = "bytes=" % QString::number(uint(fOffset)) % "-" %
-        QString::number(uint(fOffset  + length() - 1));
-      req.setRawHeader(QByteArray("Range"), rangeHdr.toLatin1());
+    QString rangeHdr;
+    if (length() == 0) {
+      rangeHdr = "bytes=" % QString::number(uint(fOffset)) % "-";
+    } else {
+      fRanges = byteRanges();
+      for (int i = 0; i < fRanges.size(); i++) {
+        rangeHdr += ((i == 0) ? "bytes=" : ",") % 
+          QString::number(uint(fRanges[i].first)) % "-" %
+          QString::number(uint(fRanges[i].second - 1));
+      }
     }
+    req.setRawHeader(QByteArray("Range"), rangeHdr.toLatin1());
     
+    requestTime.start();
     reply = manager->get(req);
     if (reply->error()) {
       requestFinished();
     } else {
+      connect(reply, SIGNAL(readyRead()), this, SLOT(dataReceived()));
       connect(reply, SIGNAL(finished()), this, SLOT(requestFinished()));
     }
   }
 
+  void NetworkRequestBundle::startParser()
+  {
+    if (parserStarted) {
+      return;
+    }
+    parserStarted = true;
+    nextReq = 0;
+    nextPos = fOffset;
+    int status = 
+      reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    parserOk = parser.start(status, reply->rawHeader("Content-Type"), 
+                            reply->rawHeader("Content-Range"), fOffset);
+  }
+
+  void NetworkRequestBundle::dataReceived()
+  {
+    if (latency < 0) {
+      latency = requestTime.elapsed();
+    }
+    startParser();
+    QByteArray data = reply->readAll();
+    bytesReceived += data.size();
+    if (parserOk) {
+      parserOk = parser.addData(data);
+      decodeReceived();
+    }
+  }
+
+  // Start decoding the objects whose bytes have all arrived. Objects arrive 
+  // in order, so stop at the first that is incomplete.
+  void NetworkRequestBundle::decodeReceived()
+  {
+    while (nextReq < reqs.size()) {
+      const NetworkReqKey &r = reqs[nextReq];
+      if (r.first != gapKey) {
+        QByteArray subData;
+        // The length of a whole object is only known at the end
+        if (r.second == 0 || !parser.find(nextPos, r.second, subData)) {
+          return;
+        }
+        cache->decodePool.start(new DecodeTask(cache, r.first, subData));
+      }
+      nextPos += r.second;
+      nextReq++;
+    }
+  }
+
+  QList<QPair<uint32_t, uint32_t> > NetworkRequestBundle::byteRanges() const
+  {
+    // Without multiple range support every gap must be fetched; with it, only
+    // gaps shorter than the overhead of another part of the reply
+    uint32_t maxFill = cache->multiRangeRequests ? multipartOverhead : 0xffffffff;
+
+    QList<QPair<uint32_t, uint32_t> > ranges;
+    uint32_t pos = fOffset, gap = 0;
+    foreach (const NetworkReqKey &req, reqs) {
+      if (req.first == gapKey) {
+        gap += req.second;
+      } else {
+        if (!ranges.isEmpty() && gap <= maxFill) {
+          ranges.last().second = pos + req.second;
+        } else {
+          ranges << qMakePair(pos, pos + req.second);
+        }
+        gap = 0;
+      }
+      pos += req.second;
+    }
+    return ranges;
+  }
+
+  uint32_t NetworkRequestBundle::fetchLength() const
+  {
+    uint32_t len = 0;
+    QList<QPair<uint32_t, uint32_t> > ranges = byteRanges();
+    for (int i = 0; i < ranges.size(); i++) {
+      len += ranges[i].second - ranges[i].first;
+    }
+    return len;
+  }
+
   void NetworkRequestBundle::requestFinished()
   {
-    QByteArray data;
-    bool ok;
-    ok = (reply->error() == QNetworkReply::NoError);
+    bool ok = (reply->error() == QNetworkReply::NoError);
+    int status = 
+      reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
     if (ok) {
-      data = reply->readAll();
-      ok = !data.isEmpty();
+      dataReceived();
+      cache->noteNetworkTiming(latency, bytesReceived, requestTime.elapsed());
+      ok = parserOk && parser.finish();
     }
 
-    int pos = 0;
-    foreach (const NetworkReqKey &r, reqs) {
+    // A server that rejects a multiple range request, or answers it in full
+    // without the ranges we asked for, doesn't support them; ask again for
+    // the missing objects one range at a time. A reply cut short says
+    // nothing about the server, so its missing objects just fail.
+    bool unsupported = fRanges.size() > 1 && 
+      (status == 400 || status == 416 || status == 501 || 
+       (ok && status == 206));
+
+    // Objects decoded while the reply arrived are done
+    uint32_t pos = parserStarted ? nextPos : fOffset;
+    for (int i = parserStarted ? nextReq : 0; i < reqs.size(); i++) {
+      const NetworkReqKey &r = reqs[i];
       Key key = r.first;
+      if (key == gapKey) {
+        pos += r.second;
+        continue;
+      }
       
       assert(r.second != 0 || reqs.size() == 1);
-      int len = (r.second == 0) ? data.size() : r.second;
-
       QByteArray subData;
-      QByteArray indexData;
-      QImage tileData;
-
-      ok = ok && (pos + len <= data.size());
-      if (ok) {
-        subData = QByteArray(data.constData() + pos, len);
-        Cache::decompressObject(key, subData, indexData, tileData);
-        NewDataEvent *ev = new NewDataEvent(key, subData, indexData, tileData);
-        QCoreApplication::postEvent(cache, ev, Qt::LowEventPriority);
+      if (ok && parser.find(pos, r.second, subData) && !subData.isEmpty()) {
+        cache->decodePool.start(new DecodeTask(cache, key, subData));
+      } else if (unsupported) {
+        if (cache->multiRangeRequests) {
+          qDebug() << "Server does not support multiple byte ranges; "
+            "falling back to single ranges";
+          cache->multiRangeRequests = false;
+        }
+        cache->retryNetworkRequest(key);
       } else {
         NewDataEvent *ev = new NewDataEvent(key, reply->errorString());
         QCoreApplication::postEvent(cache, ev);
       }
+      pos += r.second;
+    }
 
-      cache->networkRequestFinished();
-      pos += len;
+    // Errors below the content level mean the connection itself failed
+    if (reply->error() != QNetworkReply::NoError && 
+        reply->error() != QNetworkReply::OperationCanceledError &&
+        reply->error() < QNetworkReply::ProxyConnectionRefusedError) {
+      cache->noteNetworkFailure();
     }
+    cache->networkRequestFinished();
     reply->deleteLater();
     deleteLater();
   }
 
 
 
+  DecodeTask::DecodeTask(Cache *c, Key k, const QByteArray &d)
+    : cache(c), key(k), data(d)
+  {
+  }
+
+  void DecodeTask::run()
+  {
+    QByteArray indexData;
+    QImage tileData;
+    cache->decompressObject(key, data, indexData, tileData);
+    NewDataEvent *ev = new NewDataEvent(key, data, indexData, tileData);
+    QCoreApplication::postEvent(cache, ev, Qt::LowEventPriority);
+  }
+
+  LocalReadTask::LocalReadTask(Cache *c, Key k, const QString &f, uint32_t o,
+                               uint32_t l)
+    : cache(c), key(k), file(f), offset(o), len(l)
+  {
+  }
+
+  void LocalReadTask::run()
+  {
+    QByteArray data, indexData;
+    QImage tileData;
+    QString error;
+    NewDataEvent *ev;
+    if (cache->localSource->read(file, offset, len, data, error)) {
+      cache->decompressObject(key, data, indexData, tileData);
+      ev = new NewDataEvent(key, data, indexData, tileData);
+    } else {
+      ev = new NewDataEvent(key, error);
+    }
+    QCoreApplication::postEvent(cache, ev, Qt::LowEventPriority);
+  }
 
   IOThread::IOThread(Cache *v, QObject *parent)
-    : QThread(parent), cache(v)
+    : QThread(parent), cache(v), loadSequence(0)
+  {
+  }
+
+  void IOThread::postRequest(const IORequest &req)
+  {
+    queueMutex.lock();
+    if (req.kind == ClearCache || req.kind == TerminateThread) {
+      barriers.enqueue(loadSequence);
+    }
+    queue.enqueue(req);
+    queueCond.wakeOne();
+    queueMutex.unlock();
+  }
+
+  void IOThread::postLoad(const IORequest &req, uint32_t priority)
+  {
+    queueMutex.lock();
+    queueLoad(req, priority, loadSequence++);
+    queueCond.wakeOne();
+    queueMutex.unlock();
+  }
+
+  // Called with the queue mutex held
+  void IOThread::queueLoad(const IORequest &req, uint32_t priority,
+                           uint32_t sequence)
+  {
+    quint64 order = (quint64(priority) << 32) | sequence;
+    loads.insert(order, req);
+    loadOrder.insert(req.tile, order);
+    loadsBySequence.insert(sequence, order);
+  }
+
+  // Called with the queue mutex held
+  void IOThread::removeLoad(quint64 order)
+  {
+    QMap<quint64, IORequest>::iterator it = loads.find(order);
+    loadOrder.remove(it.value().tile);
+    loadsBySequence.remove(uint32_t(order));
+    loads.erase(it);
+  }
+
+  bool IOThread::cancelLoad(Key key)
+  {
+    QMutexLocker lock(&queueMutex);
+    QHash<Key, quint64>::iterator it = loadOrder.find(key);
+    if (it == loadOrder.end()) {
+      return false;
+    }
+    removeLoad(it.value());
+    return true;
+  }
+
+  void IOThread::cancelLoads()
   {
+    QMutexLocker lock(&queueMutex);
+    loads.clear();
+    loadOrder.clear();
+    loadsBySequence.clear();
+  }
+
+  void IOThread::reprioritizeLoads()
+  {
+    QMutexLocker lock(&queueMutex);
+    // Loads keep their sequence numbers, so barriers still wait for them
+    QMap<quint64, IORequest> old = loads;
+    loads.clear();
+    loadOrder.clear();
+    loadsBySequence.clear();
+    for (QMap<quint64, IORequest>::const_iterator it = old.constBegin();
+         it != old.constEnd(); ++it) {
+      queueLoad(it.value(), cache->loadPriority(it.value().tile),
+                uint32_t(it.key()));
+    }
+  }
+
+  // Choose the next request to serve. Called with the queue mutex held.
+  bool IOThread::nextRequest(IORequest &req)
+  {
+    if (!queue.isEmpty()) {
+      IORequestKind k = queue.head().kind;
+      if (k != ClearCache && k != TerminateThread) {
+        req = queue.dequeue();
+        return true;
+      }
+
+      // Barriers wait until the loads queued before them are done. Loads
+      // queued after the barrier must not hold it up, so drain the older
+      // loads first, oldest first.
+      if (loadsBySequence.isEmpty() ||
+          loadsBySequence.begin().key() >= barriers.head()) {
+        barriers.dequeue();
+        req = queue.dequeue();
+        return true;
+      }
+      quint64 order = loadsBySequence.begin().value();
+      req = loads.value(order);
+      removeLoad(order);
+      return true;
+    }
+    if (!loads.isEmpty()) {
+      req = loads.begin().value();
+      removeLoad(loads.begin().key());
+      return true;
+    }
+    return false;
   }
 
   void IOThread::run()
   {
     forever {
-      cache->tileQueueMutex.lock();
-      while (cache->tileQueue.isEmpty()) {
-        cache->tileQueueCond.wait(&cache->tileQueueMutex);
+      IORequest req(TerminateThread, 0, QVariant());
+      queueMutex.lock();
+      while (!nextRequest(req)) {
+        queueCond.wait(&queueMutex);
       }
-      IORequest req = cache->tileQueue.dequeue();
-      cache->tileQueueMutex.unlock();
+      queueMutex.unlock();
       
       
       switch (req.kind) {
       case LoadObject: {
+        QTime loadTime;
+        loadTime.start();
         QByteArray data;
         QByteArray indexData;
         QImage tileData;
@@ -220,24 +866,31 @@ namespace Cache {
           dbData.data = NULL;
           dbData.ulen = 0;
           dbData.flags = DB_DBT_USERMEM;
-          cache->objectDb->get(cache->objectDb, NULL, &dbKey, &dbData, 0);
-
-          data.resize(dbData.size);
-          dbData.data = data.data();
-          dbData.ulen = dbData.size;
-          dbData.flags = DB_DBT_USERMEM;
           int ret = cache->objectDb->get(cache->objectDb, NULL, &dbKey, &dbData, 0);
-          if (ret != 0) {
-            QString msg = tr("Error loading cached object %1").arg(req.tile);
-            qWarning() << msg;
-            data.clear();
-          }
-          else {
-            writeMetadata(req.tile, data.size());
-            Cache::decompressObject(req.tile, data, indexData, tileData);
+
+          // A missing object is expected when probing, so don't complain
+          if (ret != DB_NOTFOUND) {
+            data.resize(dbData.size);
+            dbData.data = data.data();
+            dbData.ulen = dbData.size;
+            dbData.flags = DB_DBT_USERMEM;
+            ret = cache->objectDb->get(cache->objectDb, NULL, &dbKey, &dbData, 0);
+            if (ret != 0) {
+              QString msg = tr("Error loading cached object %1").arg(req.tile);
+              qWarning() << msg;
+              data.clear();
+            }
+            else {
+              cache->decompressObject(req.tile, data, indexData, tileData);
+            }
           }
         }
         //        emit(objectLoadedFromDisk(req.tile, indexData, tileData));
+        int elapsed = loadTime.elapsed();
+        cache->ioStatsMutex.lock();
+        cache->numDiskLoads++;
+        cache->diskLoadTime += elapsed;
+        cache->ioStatsMutex.unlock();
         QCoreApplication::postEvent(cache, new NewDataEvent(req.tile, data, 
                                                             indexData, tileData),
                                     Qt::LowEventPriority);
@@ -262,7 +915,7 @@ namespace Cache {
               .arg(ret);
             qWarning() << msg;
           } else {
-            writeMetadata(req.tile, data.size());
+            writeMetadata(req.tile, req.clock, data.size());
           }
         }
         emit(objectSavedToDisk(req.tile, ret == 0));
@@ -295,22 +948,23 @@ namespace Cache {
       }
         
       case UpdateObjectMetadata: {
-        writeMetadata(req.tile, req.data.toUInt());
+        QByteArray batch = req.data.value<QByteArray>();
+        const MetadataRecord *recs = (const MetadataRecord *)batch.constData();
+        int numRecs = batch.size() / sizeof(MetadataRecord);
+        for (int i = 0; i < numRecs; i++) {
+          writeMetadata(recs[i].key, recs[i].clock, recs[i].size);
+        }
         break;
       }
 
       case ClearCache: {
-        uint32_t count;
-        if (cache->objectDb) {
-          cache->objectDb->truncate(cache->objectDb, NULL, &count, 0);
-          cache->objectDb->compact(cache->objectDb, NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
-        }
-        if (cache->timestampDb) {
-          cache->timestampDb->truncate(cache->timestampDb, NULL, &count, 0);
-          cache->timestampDb->compact(cache->timestampDb, NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
-        }
+        cache->clearCacheBarrier();
         break;
       }
+
+      case ScanCache:
+        scanDatabase();
+        break;
         
       case TerminateThread:
         return;  // Thread is done
@@ -321,9 +975,55 @@ namespace Cache {
     }
   }
 
-  void IOThread::writeMetadata(Key key, uint32_t size)
+  static bool recordLessThan(const MetadataRecord &a, const MetadataRecord &b)
   {
-    uint32_t timeSize[2] = { time(NULL), size };
+    return a.clock < b.clock;
+  }
+
+  void IOThread::scanDatabase()
+  {
+    QTime scanTime;
+    scanTime.start();
+    QVector<MetadataRecord> records;
+
+    DBC *cursor = NULL;
+    if (cache->timestampDb) {
+      cache->timestampDb->cursor(cache->timestampDb, NULL, &cursor, 0);
+    }
+    if (cursor) {
+      DBT key, data;
+      Key q;
+      uint32_t timeSize[2];
+      memset(&key, 0, sizeof(key));
+      memset(&data, 0, sizeof(data));
+      key.data = &q;
+      key.ulen = sizeof(Key);
+      key.flags = DB_DBT_USERMEM;
+      data.data = &timeSize;
+      data.ulen = sizeof(timeSize);
+      data.flags = DB_DBT_USERMEM;
+
+      while (cursor->get(cursor, &key, &data, DB_NEXT) == 0) {
+        assert(key.size == sizeof(Key) && data.size == sizeof(timeSize)); 
+        if (q == clockRecordKey) continue;
+        MetadataRecord rec;
+        rec.key = q;
+        rec.clock = timeSize[0];
+        rec.size = timeSize[1];
+        records << rec;
+      }
+      cursor->close(cursor);
+    } else {
+      qWarning() << "timestampDb.cursor() failed";
+    }
+    qSort(records.begin(), records.end(), recordLessThan);
+
+    QCoreApplication::postEvent(cache, new DiskIndexEvent(records, scanTime.elapsed()));
+  }
+
+  void IOThread::writeMetadata(Key key, uint32_t clock, uint32_t size)
+  {
+    uint32_t timeSize[2] = { clock, size };
     DBT dbKey, dbData;
     memset(&dbKey, 0, sizeof(DBT));
     memset(&dbData, 0, sizeof(DBT));
@@ -339,30 +1039,79 @@ namespace Cache {
         QString msg = tr("Timestamp put failed with return code %1").arg(ret);
         qWarning() << msg;
       }
+      cache->ioStatsMutex.lock();
+      cache->numMetadataWrites++;
+      cache->ioStatsMutex.unlock();
     }
   }
   
   
   Cache::Cache(Map *m, QNetworkAccessManager &mgr, int maxMem, int maxDisk, 
-               const QString &cp)
+               const QString &cp, int numIOThreads)
     : map(m), cachePath(cp), dbEnv(NULL), timestampDb(NULL),
       objectDb(NULL),
       manager(mgr), maxMemCache(maxMem), 
-      maxDiskCache(maxDisk),  diskLRUSize(0), memLRUSize(0),
+      maxDiskCache(maxDisk), maxCompressedCache(0), maxPrefetchCache(0), 
+      diskLRUSize(0), diskTotalSize(0), diskIndexLoaded(true), 
+      diskIndexScanPending(false), unscannedDiskSize(0), 
+      memPolicy(MemoryPolicy::create(SegmentedLRUPolicyKind)), memLRUSize(0), 
+      indexedTiles(false),
+      prefetchLRUSize(0), compressedLRUSize(0), accessClock(0), checkpointedClock(0),
+      checkpointedTotalKb(0),
       diskCacheHits(0), diskCacheMisses(0), memCacheHits(0), memCacheMisses(0), 
-    numNetworkBundles(0), numNetworkReqs(0), networkReqSize(0), requestsInFlight(0)
+      compressedCacheHits(0), prefetchRequests(0), prefetchHits(0),
+      cancelledLoads(0), droppedNetworkReqs(0), droppedNetworkBundles(0),
+      splitNetworkBundles(0), networkBytesSaved(0), focusLevel(0),
+    numNetworkBundles(0), numNetworkReqs(0), networkReqSize(0), 
+    networkLatency(initialNetworkLatency), 
+    networkBandwidth(initialNetworkBandwidth), numGapMerges(0), 
+    networkGapBytes(0), gapMergeSavings(0), multiRangeRequests(true),
+    numMultiRangeBundles(0),
+    numDiskLoads(0), diskLoadTime(0), numMetadataWrites(0), clearBarrierCount(0), 
+    clearBarrierGeneration(0), requestsInFlight(0), 
+    networkWindow(initialNetworkWindow), baseNetworkLatency(-1.0), 
+    networkWindowIncreases(0), networkWindowDecreases(0), 
+    maxRequestsInFlightSeen(0), localSource(NULL), saveLocalObjects(false),
+    numLocalReads(0), localReadBytes(0), networkSequence(0)
   {
+    if (LocalMapSource::isLocalUrl(map->baseUrl())) {
+      QString error;
+      localSource = LocalMapSource::open(map->baseUrl(), error);
+      if (!localSource) {
+        qWarning("Cannot open local map: %s", error.toLatin1().data());
+      }
+    }
+
     do {
-      uint32_t dbFlags = DB_CREATE;
+      // Database handles are shared between the IO threads. The concurrent
+      // data store permits many readers alongside a single writer.
+      uint32_t dbFlags = DB_CREATE | DB_THREAD;
       QString objectDbName = map->id() % ".db";
       QString timestampDbName = map->id() % "-timestamp.db";
       
-      uint32_t envFlags = DB_CREATE | DB_INIT_MPOOL;
+      uint32_t envFlags = DB_CREATE | DB_INIT_MPOOL | DB_INIT_CDB | DB_THREAD;
 
+      QByteArray envPath = cachePath.path().toLatin1();
       int ret = db_env_create(&dbEnv, 0);
       if (ret != 0) goto dberror;
-      ret = dbEnv->open(dbEnv, cachePath.path().toLatin1().data(), envFlags, 0);
-      if (ret != 0) goto dberror;
+      ret = dbEnv->open(dbEnv, envPath.data(), envFlags, 0);
+      if (ret != 0) {
+        // Environments left by older versions were created without the
+        // concurrent data store and cannot be joined with it. The
+        // environment only holds region files, so remove it and start over;
+        // the databases themselves are kept.
+        qWarning("Recreating tile cache environment %s", envPath.data());
+        dbEnv->close(dbEnv, 0);
+        dbEnv = NULL;
+        ret = db_env_create(&dbEnv, 0);
+        if (ret != 0) goto dberror;
+        dbEnv->remove(dbEnv, envPath.data(), DB_FORCE); // Frees the handle
+        dbEnv = NULL;
+        ret = db_env_create(&dbEnv, 0);
+        if (ret != 0) goto dberror;
+        ret = dbEnv->open(dbEnv, envPath.data(), envFlags, 0);
+        if (ret != 0) goto dberror;
+      }
       ret = db_create(&objectDb, dbEnv, 0);
       if (ret != 0) goto dberror;
       ret = db_create(&timestampDb, dbEnv, 0);
@@ -388,7 +1137,10 @@ namespace Cache {
     
 
     
-    for (int i = 0; i < numWorkerThreads; i++) {
+    if (numIOThreads <= 0) {
+      numIOThreads = std::max(1, QThread::idealThreadCount());
+    }
+    for (int i = 0; i < numIOThreads; i++) {
       IOThread *ioThread = new IOThread(this, this);
       ioThreads << ioThread;
       //      connect(ioThread, SIGNAL(objectLoadedFromDisk(Key, QByteArray, QImage)),
@@ -398,19 +1150,26 @@ namespace Cache {
       
       ioThread->start();
     }
+
+    connect(&checkpointTimer, SIGNAL(timeout()), this, SLOT(checkpointMetadata()));
+    checkpointTimer.start(checkpointInterval);
   }
   
   Cache::~Cache()
   {
-    // Terminate worker threads
-    tileQueueMutex.lock();
-    for (int i = 0; i < ioThreads.size(); i++) {
-      tileQueue.enqueue(IORequest(TerminateThread, 0, QVariant()));
+    // Decode tasks post events to the cache, so they must finish first
+    decodePool.waitForDone();
+
+    checkpointMetadata();
+
+    // Terminate worker threads. Nobody is left to receive the results of
+    // pending loads, so drop them rather than making the barrier wait.
+    foreach (IOThread *t, ioThreads) {
+      t->cancelLoads();
+      t->postRequest(IORequest(TerminateThread, 0, QVariant()));
     }
-    tileQueueCond.wakeAll();
-    tileQueueMutex.unlock();
     foreach (IOThread *t, ioThreads) {
-      t->wait(maxThreadWaitTime);
+      t->wait();
       delete t;
     }
     
@@ -421,83 +1180,343 @@ namespace Cache {
     qDebug() << "Disk cache hits: " << diskCacheHits << " misses: " << diskCacheMisses
              << " (" << 
       qreal(diskCacheHits * 100.0) / qreal(diskCacheHits + diskCacheMisses) << "%)";
+    qDebug() << "Compressed memory cache hits: " << compressedCacheHits;
+    qDebug() << "Prefetch requests: " << prefetchRequests << " hits: " << prefetchHits;
+    qDebug() << "Cancelled disk loads: " << cancelledLoads;
     qDebug() << "Network requests: " << numNetworkReqs << " size: " << networkReqSize 
              << " (" << qreal(networkReqSize) / qreal(numNetworkReqs) << " bytes per request)";
     qDebug() << "Network bundles: " << numNetworkBundles << "; " << 
       qreal(numNetworkReqs) / qreal(numNetworkBundles) << " reqs per bundle (" 
              << qreal(networkReqSize) / qreal(numNetworkBundles) 
              << " bytes per bundle)";
+    qDebug() << "Network requests dropped: " << droppedNetworkReqs << " (" 
+             << droppedNetworkBundles << " whole bundles, " << splitNetworkBundles 
+             << " bundles split, " << networkBytesSaved << " bytes saved)";
+    qDebug() << "Gap merges: " << numGapMerges << "; " << networkGapBytes 
+             << " bytes of gaps fetched vs " << gapMergeSavings 
+             << " bytes of round trip time saved (latency " << networkLatency 
+             << " ms, bandwidth " << networkBandwidth << " bytes/ms)";
+    qDebug() << "Network window: " << networkWindow << " (" 
+             << networkWindowIncreases << " increases, " << networkWindowDecreases 
+             << " decreases, at most " << maxRequestsInFlightSeen 
+             << " requests in flight; baseline latency " << baseNetworkLatency 
+             << " ms)";
+    if (localSource) {
+      qDebug() << "Local map reads: " << numLocalReads << " (" << localReadBytes
+               << " bytes)";
+    }
+    qDebug() << "Tile decodes: " << tileDecoder.numDecoded() << " ("
+             << tileDecoder.numFallbacks() << " by Qt, "
+             << tileDecoder.numReused() << " into reused buffers)";
+    qDebug() << "Multiple range requests: " << numMultiRangeBundles 
+             << (multiRangeRequests ? "" : " (not supported by server)");
+    qDebug() << "Disk loads: " << numDiskLoads << " using " << ioThreads.size()
+             << " IO threads (" << qreal(diskLoadTime) / qreal(numDiskLoads) 
+             << " ms per load)";
+    qDebug() << "Timestamp writes: " << numMetadataWrites << " (" 
+             << qreal(numMetadataWrites) / qreal(diskCacheHits + memCacheHits)
+             << " per cache hit)";
     
     // Clear the cache
-    foreach (Entry *t, cacheEntries) {
-      delete t;
+    foreach (Entry *t, cacheEntries.entries()) {
+      deleteEntry(t);
     }
-    cacheEntries.clear();
+    delete memPolicy;
     
     // Close databases
     if (objectDb)    { objectDb->close(objectDb, 0); }
     if (timestampDb) { timestampDb->close(timestampDb, 0); }
     if (dbEnv)       { dbEnv->close(dbEnv, 0); }
+
+    // Objects read from a map archive may refer to its mapping
+    delete localSource;
   }
   
+  Entry *Cache::newEntry(Key key)
+  {
+    Entry *e = entryPool.allocate(key);
+    cacheEntries.insert(e);
+    return e;
+  }
+
+  void Cache::deleteEntry(Entry *e)
+  {
+    cacheEntries.remove(e->key);
+    entryPool.release(e);
+  }
+
   void Cache::setCacheSizes(int mem, int disk) {
     maxMemCache = mem;
     maxDiskCache = disk;
     purgeMemLRU();
   }
+
+  void Cache::setPrefetchCacheSize(int mb)
+  {
+    maxPrefetchCache = mb;
+    purgePrefetchLRU();
+  }
+
+  void Cache::setCompressedCacheSize(int mb)
+  {
+    maxCompressedCache = mb;
+    purgeCompressedLRU();
+    purgeDiskLRU();
+  }
   
-  typedef QPair<uint32_t, Key> EntryTime;
   void Cache::initializeCacheFromDatabase()
   {
     if (!objectDb || !timestampDb) return;
-    
-    DBC *cursor = NULL;
-    DBT key, data;
-    Key q;
-    int ret;
 
+    // Reading every timestamp record takes a long time for a large cache, so
+    // defer it until the disk cache needs purging. Until then the size of
+    // the disk cache is the total saved at the last checkpoint.
+    diskIndexLoaded = false;
+
+    DBT key, data;
+    Key q = clockRecordKey;
+    uint32_t clockSize[2];
     memset(&key, 0, sizeof(key));
     memset(&data, 0, sizeof(data));
-    
-    // Read timestamps to get LRU order
-    timestampDb->cursor(timestampDb, NULL, &cursor, 0);
-    if (!cursor) {
-      qWarning() << "timestampDb.cursor() failed";
-      return;
-    }
-    
-    uint32_t timeSize[2];
     key.data = &q;
-    key.ulen = sizeof(Key);
-    key.flags = DB_DBT_USERMEM;
-    data.data = &timeSize;
-    data.ulen = sizeof(timeSize);
+    key.size = sizeof(Key);
+    data.data = &clockSize;
+    data.ulen = sizeof(clockSize);
     data.flags = DB_DBT_USERMEM;
-    
-    QVector<EntryTime> tiletimes;
-    while ((ret = cursor->get(cursor, &key, &data, DB_NEXT)) == 0) {
-      assert(key.size == sizeof(Key) && data.size == sizeof(timeSize)); 
-      Entry *e = new Entry(q);
-      e->diskSize = timeSize[1];
+    int ret = timestampDb->get(timestampDb, NULL, &key, &data, 0);
+    if (ret == 0 && data.size == sizeof(clockSize) && clockSize[1] > 0) {
+      accessClock = clockSize[0];
+      diskTotalSize = qint64(clockSize[1]) * 1024;
+    } else {
+      // Caches written by older versions stored wall clock times and no
+      // total. The object database file never shrinks, but it does bound
+      // the size of the objects in it.
+      accessClock = (ret == 0 && data.size == sizeof(clockSize)) ? 
+        clockSize[0] : uint32_t(time(NULL));
+      QString objectDbName = map->id() % ".db";
+      diskTotalSize = QFileInfo(cachePath, objectDbName).size();
+    }
+    unscannedDiskSize = diskTotalSize;
+    checkpointedClock = accessClock;
+  }
+
+  void Cache::loadDiskIndex(const QVector<MetadataRecord> &records)
+  {
+    diskIndexScanPending = false;
+    if (diskIndexLoaded) return; // The disk cache was emptied in the meantime
+    diskIndexLoaded = true;
+    unscannedDiskSize = 0;
+    diskTotalSize = 0;
+
+    // Objects used since startup already have entries and are newer than any
+    // object that has not been touched, so add the rest to the front of the
+    // LRU list, oldest first.
+    for (int i = records.size() - 1; i >= 0; i--) {
+      const MetadataRecord &rec = records[i];
+      diskTotalSize += rec.size;
+      if (cacheEntries.find(rec.key)) continue;
+
+      Entry *e = newEntry(rec.key);
+      e->diskSize = rec.size;
+      e->lastAccess = rec.clock;
       e->state = Disk;
-      cacheEntries[q] = e;
-      tiletimes << EntryTime(timeSize[0], q);
-    }
-    cursor->close(cursor);
-    qSort(tiletimes);
-    foreach (const EntryTime &t, tiletimes) {
-      q = t.second;
-      Entry *e = cacheEntries.value(q);
-      addToDiskLRU(*e);
+      diskLRUSize += e->diskSize;
+      diskLRU.push_front(*e);
+    }
+    purgeDiskLRU();
+  }
+
+  int Cache::ioThreadForKey(Key key) const
+  {
+    return qHash(quint64(key)) % uint(ioThreads.size());
+  }
+
+  void Cache::postIORequest(const IORequest &req)
+  {
+    if (req.kind == ClearCache) {
+      foreach (IOThread *t, ioThreads) {
+        t->postRequest(req);
+      }
+    } else if (req.kind == LoadObject) {
+      ioThreads[ioThreadForKey(req.tile)]->postLoad(req, loadPriority(req.tile));
+    } else {
+      // Requests for the same key always go to the same thread
+      ioThreads[ioThreadForKey(req.tile)]->postRequest(req);
+    }
+  }
+
+  uint32_t Cache::loadPriority(Key key)
+  {
+    // Indices are needed before any of the tiles beneath them can be fetched
+    if (keyKind(key) == IndexKind) {
+      return 0;
+    }
+
+    // Requested tiles before prefetched ones, then by distance from the focus
+    // in levels, then by distance from its center in tiles
+    Entry *e = cacheEntries.find(key);
+    uint32_t cls = (e && e->inUse) ? 1 : 2;
+    Tile tile(keyLayer(key), keyQuad(key));
+    uint32_t levels = std::min(15, abs(tile.level() - focusLevel));
+    return (cls << 28) | (levels << 24) | uint32_t(focusDistance(tile));
+  }
+
+  uint32_t Cache::networkPriority(Key key)
+  {
+    // Indices unblock the tiles waiting on them
+    if (keyKind(key) == IndexKind) {
+      return 0;
+    }
+
+    // Visible tiles before prefetched ones, and tiles nobody wants any more
+    // last. Coarser levels go first, since they are quick to fetch and can 
+    // stand in for the finer tiles; then by distance from the focus.
+    Entry *e = cacheEntries.find(key);
+    uint32_t cls = !e ? 3 : (e->inUse ? 1 : (e->isPrefetch ? 2 : 3));
+    Tile tile(keyLayer(key), keyQuad(key));
+    uint32_t level = std::min(15, tile.level());
+    return (cls << 28) | (level << 24) | uint32_t(focusDistance(tile));
+  }
+
+  // Distance of a tile from the center of the focus area, in tiles
+  int Cache::focusDistance(const Tile &tile) const
+  {
+    QRect r = map->tileToMapRect(tile);
+    int dist = (r.center() - focusArea.center()).manhattanLength() / 
+      std::max(1, r.width());
+    return std::min(dist, 0xffffff);
+  }
+
+  void Cache::setFocus(const QRect &area, int level)
+  {
+    if (area == focusArea && level == focusLevel) {
+      return;
+    }
+    focusArea = area;
+    focusLevel = level;
+    foreach (IOThread *t, ioThreads) {
+      t->reprioritizeLoads();
+    }
+    reprioritizeNetworkRequests();
+  }
+
+  void Cache::touchEntry(Entry &e)
+  {
+    e.lastAccess = ++accessClock;
+    if (e.state == Disk || e.state == Loading || e.state == DiskAndMemory ||
+        e.state == Compressed) {
+      dirtyMetadata.insert(e.key);
+      if (dirtyMetadata.size() >= maxDirtyMetadata) {
+        checkpointMetadata();
+      }
+    }
+  }
+
+  void Cache::useEntry(Entry &e)
+  {
+    e.useCount++;
+    if (traceFile.isOpen()) {
+      traceStream << "u " << e.key << "\n";
+    }
+    touchEntry(e);
+  }
+
+  void Cache::setMemoryPolicy(MemoryPolicyKind kind)
+  {
+    MemoryPolicy *policy = MemoryPolicy::create(kind);
+
+    // Hand the objects over in the old policy's eviction order
+    Entry *e;
+    while ((e = memPolicy->evict()) != NULL) {
+      policy->add(*e);
+    }
+    delete memPolicy;
+    memPolicy = policy;
+  }
+
+  void Cache::setTraceFile(const QString &path)
+  {
+    if (traceFile.isOpen()) {
+      traceStream.flush();
+      traceFile.close();
+    }
+    if (path.isEmpty()) return;
+
+    traceFile.setFileName(path);
+    if (!traceFile.open(QIODevice::WriteOnly | QIODevice::Append)) {
+      qWarning() << "Could not open cache trace file" << path;
+      return;
+    }
+    traceStream.setDevice(&traceFile);
+    traceStream << "m " << quint64(maxMemCache) * bytesPerMb << "\n";
+  }
+
+  void Cache::checkpointMetadata()
+  {
+    uint32_t totalKb = uint32_t((diskTotalSize + 1023) / 1024);
+    if (dirtyMetadata.isEmpty() && checkpointedClock == accessClock &&
+        checkpointedTotalKb == totalKb) {
+      return;
+    }
+
+    // Split the batch by IO thread, so each record is ordered with respect to
+    // other requests for the same key.
+    QVector<QByteArray> batches(ioThreads.size());
+    foreach (Key key, dirtyMetadata) {
+      Entry *e = cacheEntries.find(key);
+      if (!e || !(e->state == Disk || e->state == Loading || 
+                  e->state == DiskAndMemory || e->state == Compressed)) {
+        continue;
+      }
+      MetadataRecord rec;
+      rec.key = key;
+      rec.clock = e->lastAccess;
+      rec.size = e->diskSize;
+      batches[ioThreadForKey(key)].append((const char *)&rec, sizeof(rec));
+    }
+    dirtyMetadata.clear();
+
+    MetadataRecord clockRec;
+    clockRec.key = clockRecordKey;
+    clockRec.clock = accessClock;
+    clockRec.size = totalKb;
+    batches[ioThreadForKey(clockRecordKey)].append((const char *)&clockRec, 
+                                                   sizeof(clockRec));
+    checkpointedClock = accessClock;
+    checkpointedTotalKb = totalKb;
+
+    for (int i = 0; i < batches.size(); i++) {
+      if (!batches[i].isEmpty()) {
+        ioThreads[i]->postRequest(IORequest(UpdateObjectMetadata, 0, batches[i]));
+      }
     }
   }
-  
-  void Cache::postIORequest(const IORequest &req)
+
+  void Cache::clearCacheBarrier()
   {
-    tileQueueMutex.lock();
-    tileQueue.enqueue(req);
-    tileQueueCond.wakeOne();
-    tileQueueMutex.unlock();
+    clearBarrierMutex.lock();
+    int generation = clearBarrierGeneration;
+    clearBarrierCount++;
+    if (clearBarrierCount == ioThreads.size()) {
+      // Every thread has drained the requests queued before the clear.
+      uint32_t count;
+      if (objectDb) {
+        objectDb->truncate(objectDb, NULL, &count, 0);
+        objectDb->compact(objectDb, NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
+      }
+      if (timestampDb) {
+        timestampDb->truncate(timestampDb, NULL, &count, 0);
+        timestampDb->compact(timestampDb, NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
+      }
+      clearBarrierCount = 0;
+      clearBarrierGeneration++;
+      clearBarrierCond.wakeAll();
+    } else {
+      while (generation == clearBarrierGeneration) {
+        clearBarrierCond.wait(&clearBarrierMutex);
+      }
+    }
+    clearBarrierMutex.unlock();
   }
 
 
@@ -519,22 +1538,61 @@ namespace Cache {
   {
     assert(!e.is_linked());
     assert(e.state == DiskAndMemory || e.state == MemoryOnly);
-    assert(e.pixmap != NULL || !e.indexData.isEmpty());
+    assert(e.pixmap != NULL || !e.image.isNull() || !e.indexData.isEmpty());
     assert(!e.inUse);
     memLRUSize += e.memSize;
-    memLRU.push_back(e);
+    memPolicy->add(e);
+    if (traceFile.isOpen()) {
+      traceStream << "p " << e.key << " " << e.memSize << "\n";
+    }
   }
   
   void Cache::removeFromMemLRU(Entry &e)
   {
     assert(e.is_linked());
     memLRUSize -= e.memSize;
-    e.unlink();
+    memPolicy->remove(e);
   }
   
+  void Cache::addToCompressedLRU(Entry &e)
+  {
+    assert(!e.is_linked() && e.state == Compressed);
+    assert(!e.compressedData.isEmpty());
+    compressedLRUSize += e.compressedData.size();
+    compressedLRU.push_back(e);
+  }
+
+  void Cache::removeFromCompressedLRU(Entry &e)
+  {
+    assert(e.is_linked() && e.state == Compressed);
+    compressedLRUSize -= e.compressedData.size();
+    e.unlink();
+  }
+
+  void Cache::purgeCompressedLRU()
+  {
+    while (compressedLRUSize > qint64(maxCompressedCache) * qint64(bytesPerMb)) {
+      assert(!compressedLRU.empty());
+      Entry &e = compressedLRU.front();
+      removeFromCompressedLRU(e);
+      e.compressedData.clear();
+      e.state = Disk;
+      addToDiskLRU(e);
+    }
+  }
+
   void Cache::purgeDiskLRU()
   {
     qint64 maxDiskLRUSize = qint64(maxDiskCache) * qint64(bytesPerMb);
+    if (!diskIndexLoaded) {
+      // We can't choose objects to evict until we know what is on disk.
+      if (diskLRUSize + unscannedDiskSize > maxDiskLRUSize && 
+          !diskIndexScanPending && !ioThreads.isEmpty()) {
+        diskIndexScanPending = true;
+        ioThreads[0]->postRequest(IORequest(ScanCache, 0, QVariant()));
+      }
+      return;
+    }
     while (diskLRUSize > maxDiskLRUSize) {
       assert(!diskLRU.empty());
       Entry &e = diskLRU.front();
@@ -544,63 +1602,126 @@ namespace Cache {
       assert(e.state == Disk && e.pixmap == NULL);
       
       postIORequest(IORequest(DeleteObject, e.key, QVariant()));
-      cacheEntries.remove(e.key);
-      delete &e;
+      diskTotalSize -= e.diskSize;
+      dirtyMetadata.remove(e.key);
+      deleteEntry(&e);
     }
   }
 
   void Cache::emptyDiskCache()
   {
     postIORequest(IORequest(ClearCache, 0, QVariant()));
+    dirtyMetadata.clear();
+    checkpointedClock = 0;
+    diskIndexLoaded = true;
+    unscannedDiskSize = 0;
+    diskTotalSize = 0;
     while (!diskLRU.empty()) {
       Entry &e = diskLRU.front();
       diskLRU.pop_front();
       
       assert(e.state == Disk && e.pixmap == NULL);
       
-      cacheEntries.remove(e.key);
-      delete &e;
+      deleteEntry(&e);
     }
-
     diskLRUSize = 0;
+
+    // Compressed objects are no longer backed by the disk either
+    while (!compressedLRU.empty()) {
+      Entry &e = compressedLRU.front();
+      removeFromCompressedLRU(e);
+      deleteEntry(&e);
+    }
   }
   
   void Cache::purgeMemLRU()
   {
     while (memLRUSize > ((unsigned int)maxMemCache) * bytesPerMb) {
-      assert(!memLRU.empty());
-      Entry &e = memLRU.front();
-      
-      memLRU.pop_front();
-      memLRUSize -= e.memSize;
-      if (e.pixmap) { 
-        delete e.pixmap;
-        e.pixmap = NULL;
-      }
-      e.indexData.clear();
+      Entry *victim = memPolicy->evict();
+      assert(victim != NULL);
+      memLRUSize -= victim->memSize;
+      evictFromMemory(*victim);
+    }
+    purgeCompressedLRU();
+    purgeDiskLRU();
+  }
+
+  void Cache::evictFromMemory(Entry &e)
+  {
+    assert(!e.is_linked() && !e.inUse);
+    if (e.pixmap) { 
+      delete e.pixmap;
+      e.pixmap = NULL;
+    }
+    tileDecoder.recycle(e.image);
+    e.indexData.clear();
+    e.tileOffsets.clear();
+    e.isPrefetch = false;
       
-      if (e.state == DiskAndMemory) {
-        e.state = Disk;
-        postIORequest(IORequest(UpdateObjectMetadata, e.key, QVariant(e.diskSize)));
-        addToDiskLRU(e);
-      } else {
-        assert(e.state == MemoryOnly);
-        cacheEntries.remove(e.key);
-        delete &e;
-      }
+    if (e.state == DiskAndMemory && !e.compressedData.isEmpty() &&
+        maxCompressedCache > 0) {
+      e.state = Compressed;
+      addToCompressedLRU(e);
+    } else if (e.state == DiskAndMemory) {
+      e.compressedData.clear();
+      e.state = Disk;
+      addToDiskLRU(e);
+    } else {
+      assert(e.state == MemoryOnly);
+      deleteEntry(&e);
+    }
+  }
+
+  void Cache::addToPrefetchLRU(Entry &e)
+  {
+    assert(!e.is_linked() && !e.inUse && e.isPrefetch);
+    assert(e.state == DiskAndMemory || e.state == MemoryOnly);
+    prefetchLRUSize += e.memSize;
+    prefetchLRU.push_back(e);
+  }
+
+  void Cache::removeFromPrefetchLRU(Entry &e)
+  {
+    assert(e.is_linked() && e.isPrefetch);
+    prefetchLRUSize -= e.memSize;
+    e.unlink();
+  }
+
+  void Cache::purgePrefetchLRU()
+  {
+    while (prefetchLRUSize > ((unsigned int)maxPrefetchCache) * bytesPerMb) {
+      assert(!prefetchLRU.empty());
+      Entry &e = prefetchLRU.front();
+      removeFromPrefetchLRU(e);
+      evictFromMemory(e);
     }
+    purgeCompressedLRU();
     purgeDiskLRU();
   }
+
+  void Cache::installInMemory(Entry &e)
+  {
+    if (e.inUse) {
+      e.isPrefetch = false;
+      memInUse.push_back(e);
+    } else if (e.isPrefetch) {
+      addToPrefetchLRU(e);
+      purgePrefetchLRU();
+    } else {
+      addToMemLRU(e);
+      purgeMemLRU();
+    }
+  }
   
   void Cache::decompressObject(Key key, const QByteArray &compressed, QByteArray &indexData, QImage &tileData)
   {
     switch (keyKind(key)) {
     case IndexKind:
-      indexData = qUncompress(compressed);
+      indexData = unpackIndex(compressed);
       break;
       
     case TileKind: 
-      tileData = QImage::fromData(compressed);
+      tileData = tileDecoder.decode(compressed, indexedTiles);
       break;
 
     default: qFatal("Unknown key kind in decompressObject");
@@ -608,7 +1729,7 @@ namespace Cache {
   }
     
   bool Cache::loadObject(Entry *e, const QByteArray &indexData, 
-                         const QImage &tileData)
+                         QImage &tileData)
   {
     switch (keyKind(e->key)) {
     case IndexKind: {
@@ -619,24 +1740,25 @@ namespace Cache {
       int layer = keyLayer(e->key);
 
       int numLevels = map->indexNumLevels(layer, q);
-
-      int size = 0;
-      for (int i = 1; i <= numLevels; i++) {
-        // The formula sums the series 4 * (4^0 + 4^1 + 4^2 + 4^3 + ...) which is the size
-        // in bytes of a complete 4-way tree without a root node of 32-bit integers.
-        // See the online encyclopedia of integer sequences :-)
-        size += (((1 << (2 * (i + 2))) - 1) / 3 - 1);
+      if (!prepareIndex(e->indexData, numLevels, e->tileOffsets)) {
+        return false;
       }
-      //      qDebug() << "got index size " << e->indexData.size() << " expected " << size << " levels " << numLevels;
-
-      if (e->indexData.size() != size) return false;
-
+      e->memSize += e->tileOffsets.size() * sizeof(uint32_t);
       return true;
     }
 
     case TileKind: {
       if (tileData.isNull()) return false;
-      QPixmap *p = new QPixmap(QPixmap::fromImage(tileData));
+      if (indexedTiles && tileData.format() == QImage::Format_Indexed8) {
+        // Let go of our reference first, so sharing the palette does not
+        // copy the pixels
+        e->image = tileData;
+        tileData = QImage();
+        sharePalette(e->image);
+        e->memSize = e->image.bytesPerLine() * e->image.height();
+        return true;
+      }
+      QPixmap *p = new QPixmap(QPixmap::fromImage(expandIndexedImage(tileData)));
       e->pixmap = p;
       e->memSize = p->size().width() * p->size().height() * p->depth() / 8;
       return true;
@@ -648,6 +1770,21 @@ namespace Cache {
     }
   }
 
+  void Cache::sharePalette(QImage &image)
+  {
+    QVector<QRgb> colors = image.colorTable();
+    foreach (const QVector<QRgb> &p, palettes) {
+      if (p == colors) {
+        image.setColorTable(p);
+        return;
+      }
+    }
+    // Tiles are written with few distinct palettes
+    if (palettes.size() < maxSharedPalettes) {
+      palettes << colors;
+    }
+  }
+
   void Cache::maybeFetchIndexPendingTiles() {
     // There might be tiles waiting on this index. Run over the list of
     // objects waiting for an index.
@@ -676,6 +1813,15 @@ namespace Cache {
   {
   }
 
+  static const QEvent::Type diskIndexEventType 
+      = QEvent::Type(QEvent::registerEventType());
+
+  DiskIndexEvent::DiskIndexEvent(const QVector<MetadataRecord> &records, 
+                                 int elapsed)
+    : QEvent(diskIndexEventType), fRecords(records), fElapsed(elapsed)
+  {
+  }
+
   bool Cache::event(QEvent *ev)
   {
     if (ev->type() == newDataEventType) {
@@ -684,18 +1830,31 @@ namespace Cache {
       Key key = nev->key();
       const QByteArray &data = nev->data();
       const QByteArray &indexData = nev->indexData();
-      const QImage &tileData = nev->tileData();
-
-      assert(cacheEntries.contains(key));
-      Entry *e = cacheEntries.value(key);
-      assert(e->state == Loading || e->state == NetworkPending);
+      QImage tileData = nev->takeTileData();
+
+      Entry *e = cacheEntries.find(key);
+      assert(e != NULL);
+      assert(e->state == Loading || e->state == Probing || 
+             e->state == NetworkPending);
+      if (e->state != NetworkPending) {
+        e->unlink();  // From diskLoading
+      }
 
       bool ok = !indexData.isEmpty() || !tileData.isNull();
       if (ok) {
         ok = loadObject(e, indexData, tileData);
       }
+      tileDecoder.recycle(tileData);
       
       e->diskSize = data.size();
+      // Keep the encoded object for the compressed memory tier. It counts
+      // against the memory cache as long as the decoded object does.
+      if (ok && maxCompressedCache > 0) {
+        e->compressedData = data;
+        e->memSize += data.size();
+      } else {
+        e->compressedData.clear();
+      }
 
       switch (e->state) {
       case Loading:
@@ -712,20 +1871,50 @@ namespace Cache {
           // qDebug() << "received " << e->key << " from disk";
           e->state = DiskAndMemory;
           
-          if (e->inUse) {
-            memInUse.push_back(*e);
-          } else {
-            addToMemLRU(*e);
-            purgeMemLRU();
+          installInMemory(*e);
+        }
+        break;
+      case Probing:
+        if (!ok) {
+          // Not on disk; fetch it from the network instead.
+          diskCacheMisses++;
+          if (e->isPrefetch && !e->inUse && !networkRequestQueue.empty()) {
+            // Don't compete with requested tiles for the network
+            deleteEntry(e);
+            return true;
           }
+          e->state = IndexPending;
+          indexPending.push_back(*e);
+          maybeAddNetworkRequest(e);
+          startNetworkRequests();
+        } else {
+          diskCacheHits++;
+          e->state = DiskAndMemory;
+          touchEntry(*e);
+
+          installInMemory(*e);
         }
         break;
       case NetworkPending:
-        if (ok) {
+        if (ok && localSource && !saveLocalObjects) {
+          // The map is already on disk; read it again if it is evicted
+          localReadBytes += data.size();
+          e->state = MemoryOnly;
+          e->memSize -= e->compressedData.size();
+          e->compressedData.clear();
+          installInMemory(*e);
+        } else if (ok) {
           // qDebug() << "received " << e->key << " from network";
+          if (localSource) {
+            localReadBytes += data.size();
+          }
           e->state = Saving;
       
-          postIORequest(IORequest(SaveObject, key, data));
+          postIORequest(IORequest(SaveObject, key, data, e->lastAccess));
+        } else if (localSource) {
+          emit(ioError(tr("Error reading map file: %1")
+                       .arg(nev->errorString())));
+          deleteEntry(e);
         } else {
           // We had a network error; we have no way to restore the tile to a valid
           // state so we just dump it. If it is wanted again it will be requested
@@ -734,8 +1923,7 @@ namespace Cache {
             .arg(nev->errorString());
           emit(ioError(msg));
 
-          cacheEntries.remove(key);
-          delete e;
+          deleteEntry(e);
         }
         break;
 
@@ -751,6 +1939,12 @@ namespace Cache {
         }
       }
       return true;
+    } else if (ev->type() == diskIndexEventType) {
+      DiskIndexEvent *dev = (DiskIndexEvent *)ev;
+      qDebug() << "Read " << dev->records().size() << " cached object timestamps in "
+               << dev->elapsed() << " ms";
+      loadDiskIndex(dev->records());
+      return true;
     }
     return QObject::event(ev);
   }
@@ -758,8 +1952,27 @@ namespace Cache {
 
 void Cache::objectSavedToDisk(Key q, bool success)
 {
-  assert(cacheEntries.contains(q));
-  Entry *e = cacheEntries.value(q);
+  Entry *e = cacheEntries.find(q);
+  assert(e != NULL);
+  if (success) {
+    diskTotalSize += e->diskSize;
+  }
+  if (e->state == Storing) {
+    assert(!e->is_linked());
+    if (!success) {
+      deleteEntry(e);
+    } else if (e->inUse) {
+      // Requested while it was being written
+      e->state = Loading;
+      diskLoading.push_back(*e);
+      postIORequest(IORequest(LoadObject, q, QVariant()));
+    } else {
+      e->state = Disk;
+      addToDiskLRU(*e);
+      purgeDiskLRU();
+    }
+    return;
+  }
   assert(e->state == Saving && !e->is_linked());
 
   if (success) {
@@ -767,17 +1980,14 @@ void Cache::objectSavedToDisk(Key q, bool success)
   } else {
     // Saving failed. We'll just leave the file in the memory cache
     e->state = MemoryOnly;
+    e->memSize -= e->compressedData.size();
+    e->compressedData.clear();
 
     if (dbEnv) {
       qDebug() << "WARNING: Could not save tile to disk " << q;
     }
   }
-  if (e->inUse) {
-    memInUse.push_back(*e);
-  } else {
-    addToMemLRU(*e);
-    purgeMemLRU();
-  }
+  installInMemory(*e);
 }
 
 
@@ -791,20 +2001,52 @@ void Cache::objectSavedToDisk(Key q, bool success)
       it++;
       assert((e.state == DiskAndMemory || e.state == MemoryOnly) && e.inUse);
         
-      qkey q = keyQuad(e.key);
-      Tile tile(keyLayer(e.key), q);
-      QRect r = map->tileToMapRect(tile);
-      
-      bool inUse = false;
-      foreach (const QRect &vis, rects) {
-        inUse = inUse || r.intersects(vis);
-      }
-      if (!inUse) {
+      if (!isVisible(e.key, rects)) {
         e.unlink();
         e.inUse = false;
+        touchEntry(e);
         addToMemLRU(e);
       }
     }
+
+    // Cancel loads of tiles that are no longer wanted, if they have not 
+    // started yet. Loads that have started will land in the memory LRU.
+    it = diskLoading.begin();
+    itend = diskLoading.end();
+    while (it != itend) {
+      Entry &e = *it;
+      it++;
+      if (!e.inUse || keyKind(e.key) != TileKind || isVisible(e.key, rects)) {
+        continue;
+      }
+      e.inUse = false;
+      if (!ioThreads[ioThreadForKey(e.key)]->cancelLoad(e.key)) {
+        continue;
+      }
+      cancelledLoads++;
+      e.unlink();
+      if (e.state == Loading) {
+        e.state = Disk;
+        addToDiskLRU(e);
+      } else {
+        assert(e.state == Probing);
+        deleteEntry(&e);
+      }
+    }
+
+    // Queued network fetches of tiles no longer in view sink to the back of
+    // the queue, and are dropped when the bundle containing them is sent
+    for (BundleSet::iterator b = pendingBundles.begin(); b != pendingBundles.end();
+         ++b) {
+      foreach (const NetworkReqKey &r, b->requests()) {
+        if (r.first == gapKey) continue;
+        Entry *e = cacheEntries.find(r.first);
+        if (e->inUse && keyKind(e->key) == TileKind && !isVisible(e->key, rects)) {
+          e->inUse = false;
+        }
+      }
+    }
+    reprioritizeNetworkRequests();
     purgeMemLRU();
   }
 
@@ -818,46 +2060,60 @@ void Cache::objectSavedToDisk(Key q, bool success)
       return;
     }
 
-    uint32_t *idxData = (uint32_t *)e->indexData.constData();
-    int idxLen = e->indexData.size() / 4;
-
-    // Find the start of the tree for the tile level of q
-    int level = log2_int(q) / 2;
-    int base = 0;
-    offset = 0;
-    for (int i = 1; i < level; i++) {
-      assert(base < idxLen);
-      offset += idxData[base];
-      // base += (4^0 + 4^2 + ... + 4^i)
-      base += (((1 << (2 * (i + 1))) - 1) / 3);
-    }
-   
-    //qDebug() << "tree base " << base << " offset  " << offset;
-    int pos = 1;
-    // For all levels except the last one...
-    for (int l = 1; l <= level - 1; l++) {
-      assert(base + pos + 4 <= idxLen);
-      int digit = q & 3;
-      for (int i = 0; i < digit; i++) {
-        offset += idxData[base + pos + i];
+    findInIndex(e->indexData, e->tileOffsets, q, offset, len);
+  }
+
+  bool Cache::findTileRanges(int layer, int level, const QRect &rect, 
+                             QList<TileRange> &ranges)
+  {
+    // Neighbouring tiles mostly share an index, so look each up only once
+    QHash<qkey, Entry *> indices;
+    bool complete = true;
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+      for (int x = rect.left(); x <= rect.right(); x++) {
+        TileRange r;
+        r.tile = Tile(x, y, level, layer);
+        qkey qtile;
+        if (!map->parentIndex(layer, r.tile.toQuadKey(), r.qidx, qtile)) {
+          continue;
+        }
+        QHash<qkey, Entry *>::const_iterator it = indices.constFind(r.qidx);
+        Entry *idx;
+        if (it == indices.constEnd()) {
+          Key idxKey = indexKey(layer, r.qidx);
+          requestObject(idxKey);
+          idx = cacheEntries.find(idxKey);
+          if (!isInMemory(idx->state)) {
+            idx = NULL;
+          }
+          indices[r.qidx] = idx;
+        } else {
+          idx = it.value();
+        }
+        if (!idx) {
+          complete = false;
+          continue;
+        }
+        findTileRange(qtile, idx, r.offset, r.len);
+        ranges << r;
       }
-      
-      q >>= 2;
-      pos = 4 * (pos + digit) + 1;
     }
-    
-    assert(base + pos + 4 <= idxLen);
-    // The last level
-    int digit = q & 3;
-    for (int i = 0; i < digit; i++) {
-      offset += idxData[base + pos + i];
+    if (!complete) {
+      startNetworkRequests();
     }
-    len = idxData[base + pos + digit];
-    /* qDebug() << "q " << q0 << " " <<Tile(keyLayer(e->key), q0).toQuadKeyString() << " level " << level << " offset " << offset << " len " << len << " pos " << pos << " digit " << digit;*/
+    return complete;
   }
 
   bool Cache::requestTiles(const QList<Tile> &tiles)
   {
+    if (!tiles.isEmpty()) {
+      QRect area;
+      foreach (const Tile& tile, tiles) {
+        area |= map->tileToMapRect(tile);
+      }
+      setFocus(area, tiles.first().level());
+    }
+
     bool present = true;
     foreach (const Tile& tile, tiles) {
       qkey q = tile.toQuadKey();
@@ -870,18 +2126,140 @@ void Cache::objectSavedToDisk(Key q, bool success)
     return present;
   }
 
+  void Cache::prefetchTiles(const QList<Tile> &tiles)
+  {
+    foreach (const Tile& tile, tiles) {
+      prefetchObject(tileKey(tile.layer(), tile.toQuadKey()));
+    }
+    startNetworkRequests();
+  }
+
+  bool Cache::isVisible(Key key, const QList<QRect> &rects) const
+  {
+    QRect r = map->tileToMapRect(Tile(keyLayer(key), keyQuad(key)));
+    foreach (const QRect &vis, rects) {
+      if (r.intersects(vis)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Cache::isWantedFromNetwork(Key key)
+  {
+    Entry *e = cacheEntries.find(key);
+    assert(e != NULL && e->state == NetworkPending);
+    // Indices are needed by every pending tile beneath them
+    return keyKind(key) == IndexKind || e->inUse || e->isPrefetch;
+  }
+
+  void Cache::dropNetworkRequest(Key key)
+  {
+    Entry *e = cacheEntries.find(key);
+    assert(e != NULL && e->state == NetworkPending && !e->is_linked());
+    droppedNetworkReqs++;
+    deleteEntry(e);
+  }
+
+  void Cache::noteNetworkTiming(int latency, int bytes, int elapsed)
+  {
+    latency = qMax(1, latency);
+    networkLatency = 0.8 * networkLatency + 0.2 * latency;
+
+    // Small replies say little about bandwidth
+    int transferTime = elapsed - latency;
+    if (bytes >= 16384 && transferTime > 0) {
+      networkBandwidth = 0.8 * networkBandwidth + 0.2 * qreal(bytes) / transferTime;
+    }
+
+    // The baseline drifts upwards slowly, so it follows route changes
+    if (baseNetworkLatency < 0 || latency < baseNetworkLatency) {
+      baseNetworkLatency = latency;
+    } else {
+      baseNetworkLatency *= 1.01;
+    }
+
+    if (latency > congestedLatencyFactor * baseNetworkLatency) {
+      decreaseNetworkWindow();
+    } else if (requestsInFlight >= int(networkWindow)) {
+      // Only grow a window that is being used
+      networkWindow = qMin(maxNetworkWindow, networkWindow + 1.0 / networkWindow);
+      networkWindowIncreases++;
+    }
+  }
+
+  void Cache::decreaseNetworkWindow()
+  {
+    // Replies to requests sent before the last decrease reflect the old window
+    if (lastWindowDecrease.isValid() && 
+        lastWindowDecrease.elapsed() < networkLatency) {
+      return;
+    }
+    networkWindow = qMax(minNetworkWindow, networkWindow * networkWindowDecrease);
+    networkWindowDecreases++;
+    lastWindowDecrease.start();
+  }
+
+  void Cache::noteNetworkFailure()
+  {
+    decreaseNetworkWindow();
+  }
+
+  uint32_t Cache::maxBundleGap() const
+  {
+    // Fetching a gap is cheaper than a round trip if it transfers faster
+    return qMin(uint32_t(networkLatency * networkBandwidth), maxBundleLength());
+  }
+
+  uint32_t Cache::maxBundleLength() const
+  {
+    qreal len = bundleRoundTrips * networkLatency * networkBandwidth;
+    return uint32_t(qBound(qreal(minBundleCap), len, qreal(maxBundleCap)));
+  }
+
+  void Cache::retryNetworkRequest(Key key)
+  {
+    Entry *e = cacheEntries.find(key);
+    assert(e != NULL && e->state == NetworkPending && !e->is_linked());
+    e->state = IndexPending;
+    indexPending.push_back(*e);
+    maybeAddNetworkRequest(e);
+  }
+
   void Cache::startNetworkRequests() {
-    while (requestsInFlight < maxNetworkRequestsInFlight &&
+    while (requestsInFlight < int(networkWindow) &&
            !networkRequestQueue.empty()) {
-      NetworkRequestBundle &b = networkRequestQueue.front();
-      networkRequestQueue.pop_front();
-      networkRequests.removeOne(&b);
+      NetworkRequestBundle &b = *networkRequestQueue.begin();
+      b.BundleBaseHook::unlink();
+      b.PendingBaseHook::unlink();
+
+      // The view may have moved on since the bundle was queued
+      uint32_t dropped;
+      NetworkRequestBundle *rest = b.trim(dropped);
+      networkBytesSaved += dropped;
+      if (rest) {
+        // The remainder keeps its place in the queue
+        splitNetworkBundles++;
+        pendingBundles.insert(*rest);
+        networkRequestQueue.insert(*rest);
+      }
+      if (b.numRequests() == 0) {
+        droppedNetworkBundles++;
+        delete &b;
+        continue;
+      }
       
       numNetworkReqs += b.numRequests();
       numNetworkBundles++;
-      networkReqSize += b.length();
+      uint32_t fetched = b.fetchLength();
+      networkReqSize += fetched;
+      networkGapBytes += fetched - (b.length() - b.gapLength());
+      if (b.byteRanges().size() > 1) {
+        numMultiRangeBundles++;
+      }
       
       requestsInFlight++;
+      maxRequestsInFlightSeen = qMax(maxRequestsInFlightSeen, requestsInFlight);
       b.makeRequests(&manager);
     }
   }
@@ -907,7 +2285,7 @@ void Cache::objectSavedToDisk(Key q, bool success)
       //      qDebug() << "qidx " << qidx << " qtile " << qtile << " idxkey " << idxKey  << " file " << map->indexFile(layer, qidx);
 
       requestObject(idxKey);
-      Entry *idx = cacheEntries.value(idxKey);
+      Entry *idx = cacheEntries.find(idxKey);
     
       if (!isInMemory(idx->state)) {
         return;
@@ -922,7 +2300,7 @@ void Cache::objectSavedToDisk(Key q, bool success)
         e->state = MemoryOnly;
         e->pixmap = new QPixmap();
         e->unlink();
-        memInUse.push_back(*e);
+        installInMemory(*e);
         return;
       }
     } else {
@@ -940,106 +2318,168 @@ void Cache::objectSavedToDisk(Key q, bool success)
       qidx = q;
     }
 
-    /*    qDebug() << "Req list before insert";
-    for (int i = 0; i<networkRequests.size(); i++) {
-      qDebug() << networkRequests[i]->kind() << " " << networkRequests[i]->layer() << " " << networkRequests[i]->offset() << " " << networkRequests[i]->length();
-      }*/
+    if (localSource) {
+      numLocalReads++;
+      QString file = map->indexFile(layer, qidx) % 
+        ((keyKind(e->key) == IndexKind) ? ".idxz" : ".dat");
+      decodePool.start(new LocalReadTask(this, e->key, file, offset, len));
+      return;
+    }
+
+    queueNetworkBundle(new NetworkRequestBundle(this, map, qidx, offset, e->key,
+                                                len, this));
+  }
 
-    // First enqueue the item
-    NetworkRequestBundle *bundle =
-      new NetworkRequestBundle(this, map, qidx, offset, e->key, len, this);
-    QList<NetworkRequestBundle *>::iterator cur, next =
-      qLowerBound(networkRequests.begin(), networkRequests.end(), bundle, 
-                  NetworkRequestBundle::lessThan);
+  void Cache::queueNetworkBundle(NetworkRequestBundle *bundle)
+  {
+    BundleSet::iterator i = pendingBundles.lower_bound(*bundle);
+    NetworkRequestBundle *next = (i == pendingBundles.end()) ? NULL : &*i;
+    NetworkRequestBundle *prev = NULL;
+    if (i != pendingBundles.begin()) {
+      prev = &*--i;
+    }
+
+    bundle->updatePriority();
 
     // Try to merge the bundle with the preceding bundle
-    if (next != networkRequests.begin()) {
-      QList<NetworkRequestBundle *>::iterator prev = next - 1;
-      if ((*prev)->mergeBundle(bundle)) {
-        delete bundle;
-        bundle = *prev;
-        cur = prev;
-      } else {
-        cur = networkRequests.insert(next, bundle);
-        next = cur + 1;
-        networkRequestQueue.push_back(*bundle);
-      }
+    if (prev && prev->mergeBundle(bundle)) {
+      delete bundle;
+      bundle = prev;
     } else {
-      cur = networkRequests.insert(next, bundle);
-      next = cur + 1;
-      networkRequestQueue.push_back(*bundle);
+      pendingBundles.insert(*bundle);
     }
 
-    // Try to merge the (possibly) combined bundle with the next bundle
-    if (next != networkRequests.end()) {
-      if ((*next)->mergeBundle(bundle)) {
-        networkRequests.erase(cur);
-        delete bundle;
-      }
+    // Try to merge the (possibly) combined bundle with the next bundle.
+    // Deleting a bundle unlinks it from the set and the queue.
+    if (next && next->mergeBundle(bundle)) {
+      delete bundle;
+      bundle = next;
     }
 
-    /*qDebug() << "Req list after insert";
-    for (int i = 0; i<networkRequests.size(); i++) {
-      qDebug() << networkRequests[i]->kind() << " " << networkRequests[i]->layer() << " " << networkRequests[i]->offset() << " " << networkRequests[i]->length();
-      }*/
+    // Merging may have made the bundle more urgent. Unlinking does not 
+    // compare keys, so it is safe even though the priority has changed.
+    bundle->BundleBaseHook::unlink();
+    networkRequestQueue.insert(*bundle);
+  }
 
+  void Cache::reprioritizeNetworkRequests()
+  {
+    QVector<NetworkRequestBundle *> bundles;
+    for (BundleQueue::iterator i = networkRequestQueue.begin(); 
+         i != networkRequestQueue.end(); ++i) {
+      bundles << &*i;
+    }
+    networkRequestQueue.clear();
+    foreach (NetworkRequestBundle *b, bundles) {
+      b->updatePriority();
+      networkRequestQueue.insert(*b);
+    }
   }
 
   bool Cache::requestObject(Key key)
   {
     bool present;
-    if (cacheEntries.contains(key)) {
-      Entry *e = cacheEntries.value(key);
+    Entry *e = cacheEntries.find(key);
+    if (e) {
+      if (e->isPrefetch) {
+        prefetchHits++;
+      }
       switch (e->state) {
       case Disk: {
         // qDebug() << "request " << key << " disk cache hit";
         diskCacheHits++;
         memCacheMisses++;
         removeFromDiskLRU(*e);
-        e->state = Loading;  
+        e->state = Loading;
+        diskLoading.push_back(*e);
         e->inUse = true;
+        useEntry(*e);
         
         postIORequest(IORequest(LoadObject, key, QVariant()));
         present = false;
         break;
       }      
+      case Compressed:
+        // Only a decode is needed to bring the object back into memory
+        compressedCacheHits++;
+        memCacheMisses++;
+        removeFromCompressedLRU(*e);
+        e->state = Loading;
+        diskLoading.push_back(*e);
+        e->inUse = true;
+        useEntry(*e);
+        decodePool.start(new DecodeTask(this, key, e->compressedData));
+        present = false;
+        break;
+
       case Loading:
+      case Probing:
       case IndexPending:
       case NetworkPending:
         // qDebug() << "request " << key << " in transition";
+        if (e->isPrefetch) {
+          useEntry(*e);
+        }
         e->inUse = true;
         present = false;
         break;
 
       case Saving:
         // qDebug() << "request " << key << " in transition";
+        if (e->isPrefetch) {
+          useEntry(*e);
+        }
         e->inUse = true;
         present = true;
         break;
+
+      case Storing:
+        memCacheMisses++;
+        e->inUse = true;
+        useEntry(*e);
+        present = false;
+        break;
         
       case DiskAndMemory:
       case MemoryOnly:
         // qDebug() << "request " << key << " memory hit";
         if (!e->inUse) {
           memCacheHits++;
-          removeFromMemLRU(*e);
+          if (e->isPrefetch) {
+            removeFromPrefetchLRU(*e);
+          } else {
+            removeFromMemLRU(*e);
+          }
           memInUse.push_back(*e);
           e->inUse = true;
+          useEntry(*e);
         }
         present = true;
         break;
         
       default: abort(); // Unreachable
       }
+      e->isPrefetch = false;
+    } else if (!diskIndexLoaded && (!localSource || saveLocalObjects)) {
+      // The object may be on disk; look there before trying the network.
+      // Objects of a local map are only on disk if they are being saved.
+      memCacheMisses++;
+      e = newEntry(key);
+      e->state = Probing;
+      diskLoading.push_back(*e);
+      e->inUse = true;
+      useEntry(*e);
+      present = false;
+      postIORequest(IORequest(LoadObject, key, QVariant()));
     } else {
       // Load object from the network.
       memCacheMisses++;
       diskCacheMisses++;
       // qDebug() << "request " << key << " cache miss";
-      Entry *e = new Entry(key);
-      cacheEntries[key] = e;
+      e = newEntry(key);
       e->state = IndexPending;
       e->inUse = true;
+      useEntry(*e);
       present = false;
       indexPending.push_back(*e);
       maybeAddNetworkRequest(e);
@@ -1047,15 +2487,137 @@ void Cache::objectSavedToDisk(Key q, bool success)
     return present;
   }
 
+  void Cache::prefetchObject(Key key)
+  {
+    Entry *e = cacheEntries.find(key);
+    if (e) {
+      switch (e->state) {
+      case Disk:
+        prefetchRequests++;
+        removeFromDiskLRU(*e);
+        e->state = Loading;
+        diskLoading.push_back(*e);
+        e->isPrefetch = true;
+        postIORequest(IORequest(LoadObject, key, QVariant()));
+        break;
+
+      case Compressed:
+        prefetchRequests++;
+        removeFromCompressedLRU(*e);
+        e->state = Loading;
+        diskLoading.push_back(*e);
+        e->isPrefetch = true;
+        decodePool.start(new DecodeTask(this, key, e->compressedData));
+        break;
+
+      default:
+        // Already in memory, or on its way there
+        break;
+      }
+    } else if (!diskIndexLoaded && (!localSource || saveLocalObjects)) {
+      prefetchRequests++;
+      e = newEntry(key);
+      e->state = Probing;
+      diskLoading.push_back(*e);
+      e->isPrefetch = true;
+      e->lastAccess = accessClock;
+      postIORequest(IORequest(LoadObject, key, QVariant()));
+    } else if (networkRequestQueue.empty()) {
+      // Only use the network for prefetching when it is otherwise idle
+      prefetchRequests++;
+      e = newEntry(key);
+      e->state = IndexPending;
+      e->isPrefetch = true;
+      e->lastAccess = accessClock;
+      indexPending.push_back(*e);
+      maybeAddNetworkRequest(e);
+    }
+  }
+
+
+  bool Cache::findTile(const Tile &tile, qkey &qidx, uint32_t &offset, 
+                       uint32_t &len)
+  {
+    qkey qtile;
+    if (!map->parentIndex(tile.layer(), tile.toQuadKey(), qidx, qtile)) {
+      return false;
+    }
+    Key idxKey = indexKey(tile.layer(), qidx);
+    requestObject(idxKey);
+    Entry *idx = cacheEntries.find(idxKey);
+    if (!isInMemory(idx->state)) {
+      startNetworkRequests();
+      return false;
+    }
+    findTileRange(qtile, idx, offset, len);
+    return true;
+  }
+
+  bool Cache::isTileOnDisk(const Tile &tile)
+  {
+    Entry *e = cacheEntries.find(tileKey(tile.layer(), tile.toQuadKey()));
+    return e && (e->state == Disk || e->state == Loading || 
+                 e->state == DiskAndMemory || e->state == Compressed ||
+                 e->state == Saving || e->state == Storing);
+  }
+
+  bool Cache::loadDiskIndexNow()
+  {
+    if (!diskIndexLoaded && !diskIndexScanPending && !ioThreads.isEmpty()) {
+      diskIndexScanPending = true;
+      ioThreads[0]->postRequest(IORequest(ScanCache, 0, QVariant()));
+    }
+    return diskIndexLoaded;
+  }
+
+  bool Cache::storeTile(const Tile &tile, const QByteArray &data)
+  {
+    Key key = tileKey(tile.layer(), tile.toQuadKey());
+    if (!dbEnv) {
+      return false;
+    }
+    Entry *e = cacheEntries.find(key);
+    if (!e) {
+      e = newEntry(key);
+      e->state = Storing;
+      e->diskSize = data.size();
+      e->lastAccess = accessClock;
+      postIORequest(IORequest(SaveObject, key, data, e->lastAccess));
+      return true;
+    }
+    if (e->state == MemoryOnly) {
+      // Save a tile that is only in memory, as a tile fresh from the
+      // network is saved
+      if (e->inUse) {
+        e->unlink();
+      } else if (e->isPrefetch) {
+        removeFromPrefetchLRU(*e);
+      } else {
+        removeFromMemLRU(*e);
+      }
+      e->state = Saving;
+      e->diskSize = data.size();
+      postIORequest(IORequest(SaveObject, key, data, e->lastAccess));
+      return true;
+    }
+    // Tiles still on their way from the disk or the network can't be stored
+    // now
+    return isTileOnDisk(tile);
+  }
+
 
-bool Cache::getTile(const Tile &tile, QPixmap &p) const
+bool Cache::getTile(const Tile &tile, QPixmap &p, QImage &image) const
 {
   Key key = tileKey(tile.layer(), tile.toQuadKey());
-  if (cacheEntries.contains(key)) {
-    Entry *e = cacheEntries.value(key);
+  Entry *e = cacheEntries.find(key);
+  if (e) {
     assert(keyKind(e->key) == TileKind);
     if (isInMemory(e->state)) {
-      p = *e->pixmap;
+      if (e->pixmap) {
+        p = *e->pixmap;
+      } else {
+        image = e->image;
+      }
       return true;
     }
   } 
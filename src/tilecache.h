@@ -23,8 +23,10 @@
 #include <stdint.h>
 #include <time.h>
 #include <boost/intrusive/list.hpp>
+#include <boost/intrusive/set.hpp>
 #include <QDir>
 #include <QEvent>
+#include <QFile>
 #include <QMap>
 #include <QHash>
 #include <QMutex>
@@ -33,11 +35,21 @@
 #include <QPair>
 #include <QPixmap>
 #include <QQueue>
+#include <QRunnable>
+#include <QSet>
+#include <QTextStream>
 #include <QThread>
+#include <QThreadPool>
+#include <QTime>
+#include <QTimer>
 #include <QVariant>
+#include <QVector>
 #include <QWaitCondition>
 #include <db.h>
+#include "byteranges.h"
+#include "localsource.h"
 #include "map.h"
+#include "tiledecoder.h"
 
 class QNetworkReply;
 
@@ -61,16 +73,22 @@ namespace Cache {
   enum State {
     Disk,           // On disk, not in memory, nothing pending
     Loading,        // On disk, not yet in memory, disk read IO queued.
+    // Not known to be on disk because the disk index has not been loaded yet;
+    // disk read IO queued to find out.
+    Probing,        
     DiskAndMemory,  // Present on disk and in memory, nothing pending
+    Compressed,     // Present on disk, compressed data in memory, nothing pending
     // Present in memory but we gave up on or do not want to save to disk
     MemoryOnly,     
     Saving,         // Not yet on disk, in memory, disk write IO queued
+    Storing,        // Not yet on disk, not in memory, disk write IO queued
     NetworkPending, // Not on disk, not in memory, waiting on a network request
     IndexPending,   // Waiting for index data
     Invalid         // Dummy invalid state
   };
   
   bool isInMemory(State state);
+  Key tileKey(int layer, qkey k);
   
   // Cache object list hook
   typedef list_base_hook<link_mode<auto_unlink> > LRUBaseHook;
@@ -82,9 +100,21 @@ namespace Cache {
     
     Key key;
     QPixmap *pixmap;       
+    QImage image;          // Tile kept in 8-bit indexed form, if not a pixmap
     QByteArray indexData;
+    QVector<uint32_t> tileOffsets; // Lookup table for a version 1 index
+    QByteArray compressedData; // Encoded object, as stored on disk
     unsigned int memSize; 
     unsigned int diskSize;
+
+    // Value of the cache's access clock when this entry was last used
+    uint32_t lastAccess;
+
+    // Number of times the object has been requested while not in use; kept
+    // while the object is on disk so that memory policies can see reuse.
+    unsigned int useCount;
+    bool isProtected; // In the protected segment of a segmented LRU policy
+    bool isPrefetch;  // Loaded speculatively, and not requested since
     
     State state;
     bool inUse;   // This tile is being viewed
@@ -92,6 +122,109 @@ namespace Cache {
   typedef list< Entry, base_hook<LRUBaseHook>, constant_time_size<false> > 
     CacheList;
 
+  // Policies for choosing which decoded objects to evict from memory
+  enum MemoryPolicyKind {
+    LRUPolicyKind = 0,
+    SegmentedLRUPolicyKind = 1
+  };
+
+  // Memory policies order the decoded objects that are not in use. 
+  class MemoryPolicy {
+  public:
+    virtual ~MemoryPolicy() { }
+
+    // An object that is not in use has been decoded or released
+    virtual void add(Entry &e) = 0;
+
+    // An object is in use again
+    virtual void remove(Entry &e) = 0;
+
+    // Remove and return the next object to evict, or NULL if there is none
+    virtual Entry *evict() = 0;
+
+    static MemoryPolicy *create(MemoryPolicyKind kind);
+  };
+
+  // Evict the least recently used object
+  class LRUMemoryPolicy : public MemoryPolicy {
+  public:
+    virtual void add(Entry &e);
+    virtual void remove(Entry &e);
+    virtual Entry *evict();
+
+  private:
+    CacheList lru;
+  };
+
+  // Segmented LRU. Objects used only once since they entered the cache wait
+  // in a probationary segment and are evicted first; objects that have been 
+  // reused live in a protected segment. A fast pan across unfamiliar terrain
+  // therefore only flushes the probationary segment.
+  class SegmentedLRUMemoryPolicy : public MemoryPolicy {
+  public:
+    SegmentedLRUMemoryPolicy();
+
+    virtual void add(Entry &e);
+    virtual void remove(Entry &e);
+    virtual Entry *evict();
+
+  private:
+    CacheList probation, protectedSegment;
+    qint64 probationSize, protectedSize;
+  };
+
+  // Slab allocator for cache entries. Entries are carved out of large chunks
+  // and recycled through a free list, rather than allocated individually.
+  class EntryPool {
+  public:
+    EntryPool();
+    ~EntryPool();
+
+    Entry *allocate(Key key);
+    void release(Entry *e);
+
+  private:
+    union Slot {
+      Slot *next;
+      Key align;
+      char storage[sizeof(Entry)];
+    };
+    QList<Slot *> chunks;
+    Slot *freeList;
+  };
+
+  // Open-addressing hash table from keys to entries, using linear probing.
+  // Keys are stored alongside the entry pointers so a probe sequence touches
+  // only the bucket array.
+  class EntryTable {
+  public:
+    EntryTable();
+    ~EntryTable();
+
+    // Returns the entry for the key, or NULL if there is none.
+    Entry *find(Key key) const;
+
+    // Add an entry; its key must not already be present.
+    void insert(Entry *e);
+    void remove(Key key);
+
+    int size() const { return count; }
+    QVector<Entry *> entries() const;
+
+  private:
+    struct Bucket {
+      Key key;
+      Entry *entry; // NULL if the bucket is empty
+    };
+    Bucket *buckets;
+    int capacity;  // Always a power of 2
+    int shift;     // 64 - log2(capacity)
+    int count;
+
+    int home(Key key) const;
+    void resize(int newCapacity);
+  };
+
 
   // IO requests
   enum IORequestKind {
@@ -100,24 +233,59 @@ namespace Cache {
     DeleteObject,
     UpdateObjectMetadata,
     ClearCache,
+    ScanCache,
     TerminateThread
   };
 
   struct IORequest {
-    IORequest(IORequestKind k, Key t, QVariant d);
+    IORequest(IORequestKind k, Key t, QVariant d, uint32_t c = 0);
     
     IORequestKind kind;
     Key tile;
     
+    // For SaveObject, the object data; for UpdateObjectMetadata, a packed 
+    // array of MetadataRecords.
     QVariant data;
+
+    // Access clock value to record when saving an object
+    uint32_t clock;
+  };
+
+  // Timestamp database record written by an UpdateObjectMetadata request
+  struct MetadataRecord {
+    Key key;
+    uint32_t clock;
+    uint32_t size;
   };
   
-  // Tile IO threads
+  // Tile IO threads. Each thread owns a queue of requests; requests are
+  // assigned to threads by a hash of their key, so all operations on a given
+  // key are performed in the order they were posted. The exception is loads,
+  // which are kept apart and served in priority order; a load is only ever
+  // posted for an object whose save has completed, so loads may safely 
+  // overtake other requests. Other requests are served before loads, so 
+  // writes are never starved.
   class IOThread : public QThread {
     Q_OBJECT;
     
   public:
     IOThread(Cache *s, QObject *parent = 0);
+
+    void postRequest(const IORequest &req);
+
+    // Queue a load; smaller priorities are served first
+    void postLoad(const IORequest &req, uint32_t priority);
+
+    // Remove a queued load. Returns false if the load has already started or
+    // was never queued.
+    bool cancelLoad(Key key);
+
+    // Remove all queued loads
+    void cancelLoads();
+
+    // Recompute the priorities of all queued loads. Must be called from the
+    // main thread.
+    void reprioritizeLoads();
     
   protected:
     void run();
@@ -125,14 +293,36 @@ namespace Cache {
   private:
     Cache *cache;
 
-    void writeMetadata(Key key, uint32_t size);
+    QMutex queueMutex;
+    QWaitCondition queueCond;
+    QQueue<IORequest> queue;
+
+    // Queued loads, keyed by (priority << 32 | sequence number)
+    QMap<quint64, IORequest> loads;
+    QHash<Key, quint64> loadOrder;
+    QMap<uint32_t, quint64> loadsBySequence;
+    uint32_t loadSequence;
+    void queueLoad(const IORequest &req, uint32_t priority, uint32_t sequence);
+    void removeLoad(quint64 order);
+
+    // For each barrier in the queue, the sequence number of the first load
+    // queued after it
+    QQueue<uint32_t> barriers;
+    bool nextRequest(IORequest &req);
+
+    void writeMetadata(Key key, uint32_t clock, uint32_t size);
+    void scanDatabase();
     
   signals:
     void objectSavedToDisk(Key key, bool success);
   };
   
-  typedef list_base_hook<link_mode<auto_unlink> > BundleBaseHook;
-  class NetworkRequestBundle : public QObject, public BundleBaseHook {
+  struct QueueTag;
+  typedef set_base_hook<tag<QueueTag>, link_mode<auto_unlink> > BundleBaseHook;
+  struct PendingTag;
+  typedef set_base_hook<tag<PendingTag>, link_mode<auto_unlink> > PendingBaseHook;
+  class NetworkRequestBundle : public QObject, public BundleBaseHook, 
+                               public PendingBaseHook {
     Q_OBJECT;
   public:
     NetworkRequestBundle(Cache *cache, 
@@ -147,10 +337,31 @@ namespace Cache {
     uint32_t offset() const { return fOffset; }
     uint32_t length() const;
 
-    int numRequests() const { return reqs.size(); }
+    int numRequests() const;
+    uint32_t gapLength() const;
 
-    // Try to merge another bundle with this one. Returns true on success.
+    // Bundles are sent in order of the most urgent object they contain, then
+    // in the order they were created
+    uint32_t priority() const { return fPriority; }
+    quint64 sequence() const { return fSequence; }
+    void updatePriority();
+
+    // The half-open byte ranges to request, and their total length
+    QList<QPair<uint32_t, uint32_t> > byteRanges() const;
+    uint32_t fetchLength() const;
+
+    // Try to merge another bundle with this one. Bundles need not be adjacent;
+    // the bytes between them are fetched and discarded if that is cheaper 
+    // than another round trip. Returns true on success.
     bool mergeBundle(NetworkRequestBundle *bundle);
+
+    // Turn the objects the cache no longer wants into gaps. If a run of gaps 
+    // is too long to be worth fetching, the objects after it are moved into a
+    // new bundle, which is returned. droppedBytes is set to the length no
+    // longer fetched.
+    NetworkRequestBundle *trim(uint32_t &droppedBytes);
+
+    const QList<QPair<Key, uint32_t> > &requests() const { return reqs; }
     void makeRequests(QNetworkAccessManager *);
 
   private:
@@ -162,16 +373,77 @@ namespace Cache {
     uint32_t fOffset;           // Base offset
     // Sequence of requested objects and their lengths   
     QList<QPair<Key, uint32_t> > reqs; 
+    uint32_t fPriority;
+    quint64 fSequence;
     
 
     QNetworkReply *reply;
+    QList<QPair<uint32_t, uint32_t> > fRanges; // Ranges requested
+    QTime requestTime;
+    int latency; // Time to the first byte of the reply, or -1
+
+    // The reply is parsed as it arrives, and each object is decoded as soon
+    // as all of its bytes are in
+    ByteRangeParser parser;
+    bool parserStarted, parserOk;
+    int nextReq;       // First object not yet decoded
+    uint32_t nextPos;  // Its offset
+    qint64 bytesReceived;
+    void startParser();
+    void decodeReceived();
 
   private slots:
+    void dataReceived();
     void requestFinished();    
   };
-  typedef list< NetworkRequestBundle, base_hook<BundleBaseHook>, 
-    constant_time_size<false> > BundleList;
+  struct BundlePriorityOrder {
+    bool operator()(const NetworkRequestBundle &a, 
+                    const NetworkRequestBundle &b) const {
+      return a.priority() < b.priority() ||
+        (a.priority() == b.priority() && a.sequence() < b.sequence());
+    }
+  };
+  typedef multiset< NetworkRequestBundle, base_hook<BundleBaseHook>, 
+    compare<BundlePriorityOrder>, constant_time_size<false> > BundleQueue;
+
+  struct BundleOrder {
+    bool operator()(const NetworkRequestBundle &a, 
+                    const NetworkRequestBundle &b) const {
+      return NetworkRequestBundle::lessThan(&a, &b);
+    }
+  };
+  typedef multiset< NetworkRequestBundle, base_hook<PendingBaseHook>, 
+    compare<BundleOrder>, constant_time_size<false> > BundleSet;
+
+  // Decompresses an object received from the network on a worker thread and
+  // posts the decoded result back to the cache.
+  class DecodeTask : public QRunnable {
+  public:
+    DecodeTask(Cache *cache, Key key, const QByteArray &data);
+
+    virtual void run();
+
+  private:
+    Cache *cache;
+    Key key;
+    QByteArray data;
+  };
+
+  // Reads an object from a local map source and decodes it on a worker 
+  // thread, in place of a network request.
+  class LocalReadTask : public QRunnable {
+  public:
+    LocalReadTask(Cache *cache, Key key, const QString &file, uint32_t offset,
+                  uint32_t len);
+
+    virtual void run();
 
+  private:
+    Cache *cache;
+    Key key;
+    QString file;
+    uint32_t offset, len;
+  };
 
 
 
@@ -186,6 +458,7 @@ namespace Cache {
     const QByteArray &data() const { return fData; }
     const QByteArray &indexData() const { return fIndexData; }
     const QImage &tileData() const { return fTileData; }
+    QImage takeTileData() { QImage img = fTileData; fTileData = QImage(); return img; }
     const QString &errorString() { return fError; }
   private:
     QString fError;
@@ -194,37 +467,117 @@ namespace Cache {
     QImage fTileData;
   };
 
+  // Contents of the timestamp database in LRU order, read by an IO thread
+  class DiskIndexEvent : public QEvent {
+  public:
+    DiskIndexEvent(const QVector<MetadataRecord> &records, int elapsed);
+
+    const QVector<MetadataRecord> &records() const { return fRecords; }
+    int elapsed() const { return fElapsed; }
+  private:
+    QVector<MetadataRecord> fRecords;
+    int fElapsed;
+  };
+
+  // Location of a tile's data within its bundle file
+  struct TileRange {
+    Tile tile;
+    qkey qidx;       // Index, and hence bundle file, containing the tile
+    uint32_t offset, len;
+  };
+
 // Tile cache
 class Cache : public QObject {
   Q_OBJECT;
 public:
+  // If numIOThreads <= 0, one IO thread is started per processor core.
   Cache(Map *map, QNetworkAccessManager &mgr, int maxMem, int maxDisk, 
-        const QString &cachePath);
+        const QString &cachePath, int numIOThreads = 0);
   ~Cache();
 
   int getMemCacheSize() { return maxMemCache; }
   int getDiskCacheSize() { return maxDiskCache; }
+  int getCompressedCacheSize() { return maxCompressedCache; }
+  int getPrefetchCacheSize() { return maxPrefetchCache; }
+
+  // Network totals so far, for benchmarking
+  unsigned int getNetworkRequests() const { return numNetworkReqs; }
+  unsigned int getNetworkBundles() const { return numNetworkBundles; }
+  unsigned int getNetworkBytes() const { return networkReqSize; }
 
   void setCacheSizes(int memMb, int diskMb);
+  void setCompressedCacheSize(int mb);
+  void setPrefetchCacheSize(int mb);
+
+  void setMemoryPolicy(MemoryPolicyKind kind);
+
+  // Keep palettized tiles as 8-bit indexed images, a quarter the size of a
+  // 32-bit pixmap, to be expanded when drawn. Applies to tiles loaded from
+  // now on.
+  void setIndexedTiles(bool indexed) { indexedTiles = indexed; }
+
+  // Is the map read from the local file system rather than the network?
+  bool isLocal() const { return localSource != NULL; }
+
+  // Should objects read from a local map also be saved in the disk cache?
+  // Off by default, since the map is already on disk.
+  void setSaveLocalObjects(bool save) { saveLocalObjects = save; }
+
+  // Record cache requests and releases to a file, for replay by 
+  // util/cachesim.py. An empty path stops tracing.
+  void setTraceFile(const QString &path);
 
   void emptyDiskCache();
 
 
   // Find a tile if present in the cache; do nothing if the tile is not present.
   // Returns true if the tile was found; the pixmap will not be updated if the tile
-  // is empty.
-  bool getTile(const Tile& key, QPixmap &p) const; 
+  // is empty. A tile kept in indexed form is returned in image instead, 
+  // leaving the pixmap alone.
+  bool getTile(const Tile& key, QPixmap &p, QImage &image) const; 
 
   // Request that the cache obtain a tile; marks the tile as in use. Does nothing if
   // the tile is already available and in use.
   // Returns true if all the requested tiles are present in memory
   bool requestTiles(const QList<Tile> & key);
 
-  // Mark as unused all tiles outside the given map rectangles
+  // Load tiles that are likely to be requested soon, without marking them as
+  // in use. Prefetched tiles are kept under their own memory budget, so 
+  // prefetching never evicts tiles that have been viewed.
+  void prefetchTiles(const QList<Tile> &tiles);
+
+  // Support for downloading areas for offline use. 
+  // Find the location of a tile's data within its bundle file. If the index
+  // needed is not in memory yet, requests it and returns false.
+  bool findTile(const Tile &tile, qkey &qidx, uint32_t &offset, uint32_t &len);
+
+  // Batch form of findTile for every tile of a rectangle at one level. Tiles
+  // whose index is not in memory yet are left out, and their indices are 
+  // requested; returns true if every tile was found.
+  bool findTileRanges(int layer, int level, const QRect &tiles, 
+                      QList<TileRange> &ranges);
+
+  // Is a tile known to be in the disk cache, or being written to it? Only
+  // reliable once the disk index is loaded.
+  bool isTileOnDisk(const Tile &tile);
+
+  // Start reading the disk index if needed; returns true once it is loaded.
+  bool loadDiskIndexNow();
+
+  // Write a tile's data straight to the disk cache, unless the cache already
+  // has the tile there. Returns false if the tile could not be stored.
+  bool storeTile(const Tile &tile, const QByteArray &data);
+
+  // Mark as unused all tiles outside the given map rectangles. Queued disk 
+  // loads of such tiles are cancelled, and queued network fetches of them are
+  // dropped before they are sent.
   void pruneObjects(const QList<QRect> &rects);
 
   friend class IOThread;
   friend class NetworkRequestBundle;
+  friend class DecodeTask;
+  friend class LocalReadTask;
+  friend class NetBench;  // Times cache internals for the netbench tool
 
   virtual bool event(QEvent *e);
   
@@ -236,6 +589,9 @@ signals:
 private slots:
   void objectSavedToDisk(Key key, bool success);
 
+  // Write the access times of recently used objects to the timestamp database
+  void checkpointMetadata();
+
 private:
   Map *map;
   QDir cachePath;
@@ -247,45 +603,155 @@ private:
 
   int maxMemCache;
   int maxDiskCache;
+  int maxCompressedCache;
+  int maxPrefetchCache;
 
   // All currently loaded tiles. All tile entries must be non-NULL.
-  QHash<Key, Entry *> cacheEntries;
+  EntryPool entryPool;
+  EntryTable cacheEntries;
+  Entry *newEntry(Key key);
+  void deleteEntry(Entry *e);
 
   CacheList diskLRU;      // Tiles in state Disk
+  CacheList diskLoading;  // Tiles in state Loading or Probing
   qint64 diskLRUSize;    // Compressed size of tiles in state Disk
+  qint64 diskTotalSize;  // Size of all objects on disk
+
+  // The timestamp database is only read in full when the disk cache might
+  // need purging. Until then, objects on disk have no cache entries and
+  // requests for unknown objects probe the disk before the network.
+  bool diskIndexLoaded;
+  bool diskIndexScanPending;
+  qint64 unscannedDiskSize; // Upper bound on the size of objects not in diskLRU
+  void loadDiskIndex(const QVector<MetadataRecord> &records);
+
   void addToDiskLRU(Entry &e);
   void removeFromDiskLRU(Entry &e);
   void purgeDiskLRU();
 
   CacheList indexPending; // Objects in state IndexPending
 
-  // Tiles in state DiskAndMemory or MemoryOnly which are not in use
-  CacheList memLRU;      
+  // Tiles in state DiskAndMemory or MemoryOnly which are not in use, ordered
+  // for eviction by the memory policy
+  MemoryPolicy *memPolicy;
   unsigned int memLRUSize;
   void addToMemLRU(Entry &e);
   void removeFromMemLRU(Entry &e);
   void purgeMemLRU();
 
+  // Indexed tiles share the color tables they have in common
+  bool indexedTiles;
+  QList<QVector<QRgb> > palettes;
+  void sharePalette(QImage &image);
+
+  // Decodes tiles for the decode pool and I/O threads, and takes back the
+  // buffers of tiles leaving memory
+  TileDecoder tileDecoder;
+
   // Tiles in state DiskAndMemory or MemoryOnly which are in use.
   CacheList memInUse;   
 
+  // Prefetched tiles in state DiskAndMemory or MemoryOnly
+  CacheList prefetchLRU;
+  unsigned int prefetchLRUSize;
+  void addToPrefetchLRU(Entry &e);
+  void removeFromPrefetchLRU(Entry &e);
+  void purgePrefetchLRU();
+
+  // Place a newly decoded object on the list appropriate to its use
+  void installInMemory(Entry &e);
+
+  // Drop the decoded form of an object evicted from memory
+  void evictFromMemory(Entry &e);
+
+  // Tiles in state Compressed. Decoded objects evicted from memLRU keep their
+  // encoded form here, so bringing them back needs only a decode rather than
+  // a disk read.
+  CacheList compressedLRU;
+  qint64 compressedLRUSize;
+  void addToCompressedLRU(Entry &e);
+  void removeFromCompressedLRU(Entry &e);
+  void purgeCompressedLRU();
+
+  // LRU recency is tracked with a logical clock that ticks on every object
+  // access. Objects on disk whose access time has changed since the last 
+  // checkpoint are written back to the timestamp database in batches.
+  uint32_t accessClock;
+  uint32_t checkpointedClock; // Last access clock written to the database
+  uint32_t checkpointedTotalKb; // Last disk cache total written, in KB
+  QSet<Key> dirtyMetadata;
+  QTimer checkpointTimer;
+  void touchEntry(Entry &e);
+
+  // Note a request for an object that was not in use
+  void useEntry(Entry &e);
+
+  QFile traceFile;
+  QTextStream traceStream;
+
   unsigned int diskCacheHits, diskCacheMisses, memCacheHits, memCacheMisses;
+  unsigned int compressedCacheHits, prefetchRequests, prefetchHits;
+  unsigned int cancelledLoads;
+  unsigned int droppedNetworkReqs, droppedNetworkBundles, splitNetworkBundles;
+  qint64 networkBytesSaved;
+
+  // Is any part of an object inside one of the given map rectangles?
+  bool isVisible(Key key, const QList<QRect> &rects) const;
+
+  // Should a queued network fetch of an object still be sent?
+  bool isWantedFromNetwork(Key key);
+  void dropNetworkRequest(Key key);
+
+  // The area and level most recently requested; loads near it go first
+  QRect focusArea;
+  int focusLevel;
+  uint32_t loadPriority(Key key);
+  uint32_t networkPriority(Key key);
+  int focusDistance(const Tile &tile) const;
+  void setFocus(const QRect &area, int level);
   unsigned int numNetworkBundles, numNetworkReqs, networkReqSize;
 
+  // Bundles are coalesced across gaps shorter than the bandwidth-delay 
+  // product, and capped at a few round trips' worth of transfer
+  qreal networkLatency;   // ms
+  qreal networkBandwidth; // bytes per ms
+  void noteNetworkTiming(int latency, int bytes, int elapsed);
+  uint32_t maxBundleGap() const;
+  uint32_t maxBundleLength() const;
+  unsigned int numGapMerges;
+  qint64 networkGapBytes;   // Unwanted bytes fetched to fill gaps
+  qint64 gapMergeSavings;   // Bytes that could have been sent in the round
+                            // trips saved by merging across gaps
+
+  // Ask for all the ranges of a bundle in one request? Cleared if the server
+  // turns out not to support multiple ranges.
+  bool multiRangeRequests;
+  unsigned int numMultiRangeBundles;
+  void retryNetworkRequest(Key key);
+
 
   // Everything below this point is accessed by tile IO threads
-  // Public for thread class
-  QMutex tileQueueMutex;
-  QWaitCondition tileQueueCond;
-  // If tile.level < 0, terminate the thread.
-  // If bytearray is null, load a tile
-  // If bytearray is non-null, save a tile.
-  QQueue<IORequest> tileQueue;
   QList<IOThread *> ioThreads;
+  int ioThreadForKey(Key key) const;
   void postIORequest(const IORequest &req);
+
+  // Disk IO statistics, updated by the IO threads
+  QMutex ioStatsMutex;
+  unsigned int numDiskLoads;
+  qint64 diskLoadTime; // Total time spent servicing loads, in ms
+  unsigned int numMetadataWrites;
+
+  // Cache clearing must be ordered with respect to every queued request, so
+  // a ClearCache request is posted to every IO thread; the threads wait for
+  // each other at a barrier and the last to arrive truncates the databases.
+  QMutex clearBarrierMutex;
+  QWaitCondition clearBarrierCond;
+  int clearBarrierCount;
+  int clearBarrierGeneration;
+  void clearCacheBarrier();
   
 
-  // Save the disk cache index
+  // Read the cache state that is needed at startup from the database
   void initializeCacheFromDatabase();
 
 
@@ -293,23 +759,53 @@ private:
 
   // Request an object. Returns true if the object is present in memory right now.
   bool requestObject(const Key key);
-  static void decompressObject(Key key, const QByteArray &compressed, QByteArray &indexData, QImage &tileData);
-  bool loadObject(Entry *e, const QByteArray &indexData, const QImage &tileData);
+  void prefetchObject(const Key key);
+  void decompressObject(Key key, const QByteArray &compressed, QByteArray &indexData, QImage &tileData);
+  bool loadObject(Entry *e, const QByteArray &indexData, QImage &tileData);
 
   void maybeFetchIndexPendingTiles();
   void maybeAddNetworkRequest(Entry *e);
 
   // Network request that haven't yet been posted, awaiting coalescing
 
+  // Worker threads that decode objects received from the network, so the GUI
+  // thread only installs decoded objects.
+  QThreadPool decodePool;
+
 
   void networkRequestFinished();
   int requestsInFlight;
 
-  // Requests ordered by the bundle less than operator
-  QList<NetworkRequestBundle *> networkRequests;
-
-  // Requests in FIFO order
-  BundleList networkRequestQueue;
+  // Congestion window for network requests. It grows by one request per
+  // window's worth of uncongested replies and shrinks multiplicatively, at
+  // most once per round trip, when the time to first byte rises well above
+  // the lowest recently seen, or when a request fails.
+  qreal networkWindow;
+  qreal baseNetworkLatency; // ms, or negative if unknown
+  QTime lastWindowDecrease;
+  unsigned int networkWindowIncreases, networkWindowDecreases;
+  int maxRequestsInFlightSeen;
+  void decreaseNetworkWindow();
+  void noteNetworkFailure();
+
+  // Bundle files of a map on the local file system, or NULL. Objects of a 
+  // local map are read directly on the decode pool and never queued for the
+  // network.
+  LocalMapSource *localSource;
+  bool saveLocalObjects;
+  unsigned int numLocalReads;
+  qint64 localReadBytes;
+
+  // Requests not yet sent, ordered by index, layer, kind and offset, so a new
+  // request finds the neighbours it might merge with in logarithmic time
+  BundleSet pendingBundles;
+  void queueNetworkBundle(NetworkRequestBundle *bundle);
+
+  // Requests in dispatch order. Priorities are recomputed when the view
+  // moves.
+  BundleQueue networkRequestQueue;
+  quint64 networkSequence;
+  void reprioritizeNetworkRequests();
   void startNetworkRequests();
 };
 
@@ -0,0 +1,238 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <csetjmp>
+#include <cstring>
+#include <png.h>
+#include <QMutexLocker>
+#include <QVector>
+#include "pixelkernels.h"
+#include "tiledecoder.h"
+
+// Most buffers to keep for reuse
+static const int maxPooledImages = 16;
+
+// Largest tile to decode with libpng
+static const png_uint_32 maxTileSize = 4096;
+
+struct PngSource {
+  const uchar *data;
+  size_t size, pos;
+};
+
+static void readPngData(png_structp png, png_bytep out, png_size_t len)
+{
+  PngSource *src = (PngSource *)png_get_io_ptr(png);
+  if (len > src->size - src->pos) {
+    png_error(png, "truncated PNG");
+  }
+  memcpy(out, src->data + src->pos, len);
+  src->pos += len;
+}
+
+static void pngError(png_structp png, png_const_charp)
+{
+  longjmp(png_jmpbuf(png), 1);
+}
+
+static void pngWarning(png_structp, png_const_charp)
+{
+}
+
+// The header of a palettized PNG, and its colors as QRgb values. Only 
+// plain data is touched between setjmp and longjmp.
+struct PngHeader {
+  png_uint_32 width, height;
+  QRgb colors[256];
+  int numColors;
+  bool alpha;
+};
+
+static bool readPngHeader(png_structp png, png_infop info, PngHeader &h)
+{
+  if (setjmp(png_jmpbuf(png))) {
+    return false;
+  }
+  png_read_info(png, info);
+  int bitDepth, colorType, interlace;
+  png_get_IHDR(png, info, &h.width, &h.height, &bitDepth, &colorType, 
+               &interlace, NULL, NULL);
+  if (colorType != PNG_COLOR_TYPE_PALETTE || interlace != PNG_INTERLACE_NONE ||
+      h.width == 0 || h.height == 0 || h.width > maxTileSize || 
+      h.height > maxTileSize) {
+    return false;
+  }
+  if (bitDepth < 8) {
+    png_set_packing(png);
+  }
+  png_read_update_info(png, info);
+
+  png_colorp palette;
+  int numPalette = 0;
+  if (!png_get_PLTE(png, info, &palette, &numPalette)) {
+    return false;
+  }
+  png_bytep trans = NULL;
+  int numTrans = 0;
+  if (!png_get_valid(png, info, PNG_INFO_tRNS) ||
+      !png_get_tRNS(png, info, &trans, &numTrans, NULL)) {
+    numTrans = 0;
+  }
+
+  // Pixels past the palette are black, as Qt has them
+  h.numColors = numPalette;
+  h.alpha = false;
+  for (int i = 0; i < 256; i++) {
+    int a = i < numTrans ? trans[i] : 0xff;
+    h.colors[i] = i < numPalette ? 
+      qRgba(palette[i].red, palette[i].green, palette[i].blue, a) : 0xff000000;
+    h.alpha = h.alpha || a != 0xff;
+  }
+  return true;
+}
+
+// Read the rows of a PNG into rows, expanding them through palette unless
+// it is NULL; buffer holds a row of indices
+static bool readPngRows(png_structp png, uchar **rows, int height, int width,
+                        const QRgb *palette, uchar *buffer)
+{
+  if (setjmp(png_jmpbuf(png))) {
+    return false;
+  }
+  const PixelKernels &k = pixelKernels();
+  for (int y = 0; y < height; y++) {
+    if (palette) {
+      png_read_row(png, buffer, NULL);
+      k.expandPalette(buffer, (QRgb *)rows[y], width, palette);
+    } else {
+      png_read_row(png, rows[y], NULL);
+    }
+  }
+  return true;
+}
+
+TileDecoder::TileDecoder()
+  : decoded(0), fallbacks(0), reused(0)
+{
+}
+
+QImage TileDecoder::acquire(int width, int height, QImage::Format format)
+{
+  {
+    QMutexLocker lock(&poolMutex);
+    for (int i = 0; i < pool.size(); i++) {
+      const QImage &img = pool[i];
+      if (img.width() == width && img.height() == height && 
+          img.format() == format) {
+        reused++;
+        return pool.takeAt(i);
+      }
+    }
+  }
+  return QImage(width, height, format);
+}
+
+void TileDecoder::recycle(QImage &image)
+{
+  if (!image.isNull() && image.isDetached()) {
+    QMutexLocker lock(&poolMutex);
+    if (pool.size() >= maxPooledImages) {
+      pool.removeFirst();
+    }
+    pool << image;
+  }
+  image = QImage();
+}
+
+bool TileDecoder::decodePng(const QByteArray &data, bool indexed, 
+                            QImage &image)
+{
+  if (data.size() < 8 || png_sig_cmp((png_bytep)data.constData(), 0, 8) != 0) {
+    return false;
+  }
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, 
+                                           pngError, pngWarning);
+  if (!png) {
+    return false;
+  }
+  png_infop info = png_create_info_struct(png);
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    return false;
+  }
+  PngSource src = { (const uchar *)data.constData(), size_t(data.size()), 0 };
+  png_set_read_fn(png, &src, readPngData);
+
+  PngHeader h;
+  bool ok = readPngHeader(png, info, h);
+  if (ok) {
+    int width = h.width, height = h.height;
+    QImage::Format format = indexed ? QImage::Format_Indexed8 : 
+      (h.alpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    image = acquire(width, height, format);
+    if (image.isNull()) {
+      ok = false;
+    }
+
+    QVector<uchar *> rows(height);
+    for (int y = 0; ok && y < height; y++) {
+      rows[y] = image.scanLine(y);
+    }
+    QVector<uchar> buffer(width);
+    if (indexed) {
+      QVector<QRgb> colorTable(h.numColors);
+      memcpy(colorTable.data(), h.colors, h.numColors * sizeof(QRgb));
+      image.setColorTable(colorTable);
+    } else if (h.alpha) {
+      for (int i = 0; i < 256; i++) {
+        QRgb c = h.colors[i];
+        int a = qAlpha(c);
+        h.colors[i] = qRgba(qRed(c) * a / 255, qGreen(c) * a / 255, 
+                            qBlue(c) * a / 255, a);
+      }
+    }
+    ok = ok && readPngRows(png, rows.data(), height, width, 
+                           indexed ? NULL : h.colors, buffer.data());
+  }
+  png_destroy_read_struct(&png, &info, NULL);
+  if (!ok) {
+    recycle(image);
+  }
+  return ok;
+}
+
+QImage TileDecoder::decode(const QByteArray &data, bool indexed)
+{
+  QImage image;
+  bool ok = decodePng(data, indexed, image);
+  {
+    QMutexLocker lock(&poolMutex);
+    decoded++;
+    if (!ok) fallbacks++;
+  }
+  if (ok) {
+    return image;
+  }
+
+  image = QImage::fromData(data);
+  if (!indexed && image.format() == QImage::Format_Indexed8) {
+    image = expandIndexedImage(image);
+  }
+  return image;
+}
@@ -0,0 +1,62 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TILEDECODER_H
+#define TILEDECODER_H 1
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+#include <QMutex>
+
+// Decodes palettized tile PNGs with libpng, straight into images whose 
+// buffers are recycled once the cache is done with them, rather than going
+// through QImage::fromData, which probes the format and allocates afresh for
+// every tile. Tiles are decoded either as 8-bit indexed images or expanded
+// to 32-bit pixels as they are read, whichever the display path wants.
+// Other images are left to QImage::fromData. Safe to use from several 
+// threads at once.
+class TileDecoder {
+ public:
+  TileDecoder();
+
+  // Decode a tile; an invalid image is returned if the data is not an image.
+  // If indexed is false, palettized tiles are expanded to Format_RGB32, or
+  // Format_ARGB32_Premultiplied if they have any transparency.
+  QImage decode(const QByteArray &data, bool indexed);
+
+  // Offer the buffer of a decoded image for reuse. The image is taken if
+  // nothing else refers to it, and cleared in any case.
+  void recycle(QImage &image);
+
+  // Statistics
+  unsigned int numDecoded() const { return decoded; }
+  unsigned int numFallbacks() const { return fallbacks; }
+  unsigned int numReused() const { return reused; }
+
+ private:
+  QMutex poolMutex;
+  QList<QImage> pool;
+  unsigned int decoded, fallbacks, reused;
+
+  QImage acquire(int width, int height, QImage::Format format);
+  bool decodePng(const QByteArray &data, bool indexed, QImage &image);
+};
+
+#endif
@@ -0,0 +1,275 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <cassert>
+#include <cstring>
+#include "tileindex.h"
+
+static const char indexV2Magic[4] = { 'Z', 'T', 'I', '2' };
+static const int indexV2HeaderWords = 2;
+static const int indexV2LevelWords = 6;
+
+// Number of 32-bit words in a version 1 tree for a tile level
+static inline int indexTreeSize(int level)
+{
+  return ((1 << (2 * (level + 1))) - 1) / 3;
+}
+
+// Index of the first node of the version 1 tree for a tile level
+static inline int indexTreeBase(int level)
+{
+  // Sum of 4^0 + ... + 4^i for i = 1 .. level - 1
+  quint64 p = quint64(1) << (2 * (level + 1));
+  return int(((p - 16) / 3 - (level - 1)) / 3);
+}
+
+// Position of the leaf for q among the leaves of its level; the first digit
+// of a quadkey is in its least significant bits
+static inline uint32_t quadLeafNumber(qkey q, int level)
+{
+  if (level == 0) return 0;
+  uint32_t d = q & ((uint32_t(1) << (2 * level)) - 1);
+  d = ((d >> 2) & 0x33333333) | ((d & 0x33333333) << 2);
+  d = ((d >> 4) & 0x0f0f0f0f) | ((d & 0x0f0f0f0f) << 4);
+  d = ((d >> 8) & 0x00ff00ff) | ((d & 0x00ff00ff) << 8);
+  d = (d >> 16) | (d << 16);
+  return d >> (32 - 2 * level);
+}
+
+static inline int popCount(uint32_t x)
+{
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  x = (x + (x >> 4)) & 0x0f0f0f0f;
+  return (x * 0x01010101) >> 24;
+}
+
+static inline bool readVarint(const uchar *&p, const uchar *end, uint32_t &v)
+{
+  v = 0;
+  for (int shift = 0; shift < 35 && p < end; shift += 7) {
+    uchar c = *p++;
+    v |= uint32_t(c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+bool isIndexV2(const QByteArray &raw)
+{
+  return raw.size() >= indexV2HeaderWords * 4 && 
+    memcmp(raw.constData(), indexV2Magic, sizeof(indexV2Magic)) == 0;
+}
+
+QByteArray unpackIndex(const QByteArray &raw)
+{
+  return isIndexV2(raw) ? raw : qUncompress(raw);
+}
+
+// Compute the offset of every node of a version 1 index, so that finding a
+// tile is a single lookup rather than a walk down the tree
+static void buildTileOffsets(const QByteArray &index, int numLevels,
+                             QVector<uint32_t> &offsets)
+{
+  const uint32_t *idxData = (const uint32_t *)index.constData();
+  offsets.resize(index.size() / 4);
+  int base = 0;
+  uint32_t start = 0;
+  for (int level = 1; level <= numLevels; level++) {
+    int nodes = indexTreeSize(level);
+    assert(base + nodes <= offsets.size());
+    offsets[base] = start;
+    // The children of node k are nodes 4k + 1 .. 4k + 4
+    for (int k = 0; 4 * k + 4 < nodes; k++) {
+      uint32_t off = offsets[base + k];
+      for (int c = 1; c <= 4; c++) {
+        offsets[base + 4 * k + c] = off;
+        off += idxData[base + 4 * k + c];
+      }
+    }
+    start += idxData[base];
+    base += nodes;
+  }
+}
+
+// Is [pos, pos + words) a properly aligned run of words within the index?
+static bool validWords(const QByteArray &index, uint32_t pos, uint32_t words)
+{
+  return pos % 4 == 0 && pos <= uint32_t(index.size()) && 
+    words <= (uint32_t(index.size()) - pos) / 4;
+}
+
+// Check every table of a version 2 index, so lookups need no bounds checks
+static bool checkIndexV2(const QByteArray &index, int numLevels)
+{
+  const uint32_t *w = (const uint32_t *)index.constData();
+  if (!validWords(index, 0, indexV2HeaderWords + indexV2LevelWords * numLevels) ||
+      int(w[1]) != numLevels) {
+    return false;
+  }
+  const uchar *data = (const uchar *)index.constData();
+  const uchar *end = data + index.size();
+  for (int level = 1; level <= numLevels; level++) {
+    const uint32_t *lv = w + indexV2HeaderWords + indexV2LevelWords * (level - 1);
+    uint32_t numTiles = lv[1];
+    uint32_t leaves = uint32_t(1) << (2 * level);
+    uint32_t bitmapWords = (leaves + 31) / 32;
+    uint32_t checkpoints = (numTiles + indexCheckpointInterval - 1) / 
+      indexCheckpointInterval;
+    if (numTiles > leaves || !validWords(index, lv[2], bitmapWords) ||
+        !validWords(index, lv[3], bitmapWords) ||
+        !validWords(index, lv[4], 2 * checkpoints) || 
+        lv[5] > uint32_t(index.size())) {
+      return false;
+    }
+
+    const uint32_t *bitmap = w + lv[2] / 4, *rank = w + lv[3] / 4;
+    if (leaves < 32 && (bitmap[0] >> leaves) != 0) {
+      return false;
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < bitmapWords; i++) {
+      if (rank[i] != count) return false;
+      count += popCount(bitmap[i]);
+    }
+    if (count != numTiles) {
+      return false;
+    }
+
+    const uint32_t *checkpoint = w + lv[4] / 4;
+    const uchar *lengths = data + lv[5], *p = lengths;
+    uint32_t off = 0;
+    for (uint32_t t = 0; t < numTiles; t++) {
+      if (t % indexCheckpointInterval == 0) {
+        if (checkpoint[0] != off || checkpoint[1] != uint32_t(p - lengths)) {
+          return false;
+        }
+        checkpoint += 2;
+      }
+      uint32_t len;
+      if (!readVarint(p, end, len)) return false;
+      off += len;
+    }
+  }
+  return true;
+}
+
+bool prepareIndex(const QByteArray &index, int numLevels, 
+                  QVector<uint32_t> &offsets)
+{
+  offsets.clear();
+  if (isIndexV2(index)) {
+    return checkIndexV2(index, numLevels);
+  }
+
+  int size = 0;
+  for (int i = 1; i <= numLevels; i++) {
+    size += indexTreeSize(i) * 4;
+  }
+  if (index.size() != size) {
+    return false;
+  }
+  buildTileOffsets(index, numLevels, offsets);
+  return true;
+}
+
+static void findInIndexV2(const QByteArray &index, qkey q, uint32_t &offset,
+                          uint32_t &len)
+{
+  const uint32_t *w = (const uint32_t *)index.constData();
+  int level = log2_int(q) / 2;
+  const uint32_t *lv = w + indexV2HeaderWords + indexV2LevelWords * (level - 1);
+  uint32_t leaf = quadLeafNumber(q, level);
+  uint32_t bits = w[lv[2] / 4 + leaf / 32];
+  uint32_t bit = uint32_t(1) << (leaf % 32);
+  offset = lv[0];
+  len = 0;
+  if (!(bits & bit)) {
+    return;
+  }
+
+  // Count the tiles before this one, then sum their lengths from the nearest
+  // checkpoint
+  uint32_t r = w[lv[3] / 4 + leaf / 32] + popCount(bits & (bit - 1));
+  const uint32_t *checkpoint = w + lv[4] / 4 + 2 * (r / indexCheckpointInterval);
+  const uchar *p = (const uchar *)index.constData() + lv[5] + checkpoint[1];
+  const uchar *end = (const uchar *)index.constData() + index.size();
+  uint32_t v;
+  offset += checkpoint[0];
+  for (uint32_t i = 0; i < r % indexCheckpointInterval; i++) {
+    readVarint(p, end, v);
+    offset += v;
+  }
+  readVarint(p, end, len);
+}
+
+void findInIndex(const QByteArray &index, const QVector<uint32_t> &offsets,
+                 qkey q, uint32_t &offset, uint32_t &len)
+{
+  int level = log2_int(q) / 2;
+  assert(level >= 1);
+  if (isIndexV2(index)) {
+    findInIndexV2(index, q, offset, len);
+    return;
+  }
+  int n = indexTreeBase(level) + ((1 << (2 * level)) - 1) / 3 + 
+    quadLeafNumber(q, level);
+  assert(n < offsets.size());
+  offset = offsets[n];
+  len = ((const uint32_t *)index.constData())[n];
+}
+
+void walkIndexV1(const QByteArray &index, qkey q, uint32_t &offset, 
+                 uint32_t &len)
+{
+  uint32_t *idxData = (uint32_t *)index.constData();
+  int idxLen = index.size() / 4;
+
+  // Find the start of the tree for the tile level of q
+  int level = log2_int(q) / 2;
+  int base = 0;
+  offset = 0;
+  for (int i = 1; i < level; i++) {
+    assert(base < idxLen);
+    offset += idxData[base];
+    // base += (4^0 + 4^2 + ... + 4^i)
+    base += indexTreeSize(i);
+  }
+   
+  int pos = 1;
+  // For all levels except the last one...
+  for (int l = 1; l <= level - 1; l++) {
+    assert(base + pos + 4 <= idxLen);
+    int digit = q & 3;
+    for (int i = 0; i < digit; i++) {
+      offset += idxData[base + pos + i];
+    }
+      
+    q >>= 2;
+    pos = 4 * (pos + digit) + 1;
+  }
+    
+  assert(base + pos + 4 <= idxLen);
+  // The last level
+  int digit = q & 3;
+  for (int i = 0; i < digit; i++) {
+    offset += idxData[base + pos + i];
+  }
+  len = idxData[base + pos + digit];
+}
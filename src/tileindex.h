@@ -0,0 +1,74 @@
+/*
+  ZTopo --- a viewer for topographic maps
+  Copyright (C) 2010 Peter Hawkins
+  
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef TILEINDEX_H
+#define TILEINDEX_H 1
+
+#include <stdint.h>
+#include <QByteArray>
+#include <QVector>
+#include "map.h"
+
+// An index object locates the tiles of one bundle file, over a number of 
+// tile levels below the index's own quadtree node. There are two formats:
+//
+// Version 1 is a zlib-compressed (qCompress) array of 32-bit lengths forming
+// one complete 4-way tree per level. The root of each tree is the total 
+// length of that level and every other node the total length of the tiles
+// beneath it; the leaves are the tiles in quadkey order. Offsets are found
+// by summing, so a table of node offsets is derived when the index loads.
+//
+// Version 2 is not compressed and is used in place. It starts with the
+// magic "ZTI2" and the number of levels, followed by a table of six 32-bit
+// words per level: the offset in the bundle of the level's first tile, the
+// number of tiles present, and the positions within the index of the 
+// level's presence bitmap, its rank table, its checkpoints and its lengths.
+//   - The bitmap has one bit per leaf in quadkey order, in 32-bit words. 
+//   - The rank table holds the number of bits set before each bitmap word.
+//   - Every indexCheckpointInterval-th present tile has a checkpoint of two
+//     words: its offset from the start of the level, and the position of its
+//     length from the start of the level's lengths.
+//   - Lengths of the present tiles are unsigned LEB128 varints.
+// All words are little-endian and 4-byte aligned. util/indexv2.py writes 
+// this format.
+
+static const int indexCheckpointInterval = 16;
+
+// Is this raw index object (as stored in a bundle) in the version 2 format?
+bool isIndexV2(const QByteArray &raw);
+
+// The form of a raw index object used for lookups
+QByteArray unpackIndex(const QByteArray &raw);
+
+// Check an unpacked index with numLevels levels, and build the lookup table
+// it needs, if any. Returns false if the index is malformed.
+bool prepareIndex(const QByteArray &index, int numLevels, 
+                  QVector<uint32_t> &offsets);
+
+// Find the offset and length of tile q of a prepared index, where q is 
+// relative to the index's node. Tiles not present have length 0.
+void findInIndex(const QByteArray &index, const QVector<uint32_t> &offsets,
+                 qkey q, uint32_t &offset, uint32_t &len);
+
+// Find a tile in a version 1 index by walking down its tree, without the 
+// offset table. Kept for checking and benchmarking.
+void walkIndexV1(const QByteArray &index, qkey q, uint32_t &offset, 
+                 uint32_t &len);
+
+#endif
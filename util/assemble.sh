@@ -1,9 +1,15 @@
 #!/bin/sh
+# Usage: assemble.sh <series> [-2]
+# With -2, indices are written in the version 2 format.
 
 series="$1"
 mkdir -p final/$series
 for bucket in `cat "$series"-buckets.txt`; do
-    ~/geo/ztopo/util/compress.py $series-$bucket.idx 
+    if [ "$2" = "-2" ]; then
+        ~/geo/ztopo/util/indexv2.py $series-$bucket.idx
+    else
+        ~/geo/ztopo/util/compress.py $series-$bucket.idx 
+    fi
     cp $series-$bucket.idxz final/$series/$bucket.idxz
     cat $series-$bucket.lst | xargs cat >> final/$series/$bucket.dat
 done
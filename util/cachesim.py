@@ -0,0 +1,121 @@
+#!/usr/bin/python
+
+# Replay a memory cache trace written by ZTopo (see the cacheTraceFile
+# setting) under each memory policy, and report the hit ratios.
+#
+# Trace lines are:
+#   m <bytes>         memory cache budget when tracing started
+#   u <key>           request for an object that was not in use
+#   p <key> <size>    object of <size> bytes no longer in use; may be evicted
+
+import sys
+from collections import OrderedDict
+
+if len(sys.argv) < 2:
+    print("Usage: cachesim <trace file> [memory cache size in MB] ...")
+    sys.exit(1)
+
+maxProtectedFraction = 0.8
+
+class LRU:
+    def __init__(self):
+        self.lru = OrderedDict()
+
+    def add(self, key, size, uses):
+        self.lru[key] = size
+
+    def remove(self, key):
+        del self.lru[key]
+
+    def evict(self):
+        return self.lru.popitem(False)
+
+class SegmentedLRU:
+    def __init__(self):
+        self.probation = OrderedDict()
+        self.protected = OrderedDict()
+        self.probationSize = 0
+        self.protectedSize = 0
+
+    def add(self, key, size, uses):
+        if uses <= 1:
+            self.probation[key] = size
+            self.probationSize += size
+            return
+        self.protected[key] = size
+        self.protectedSize += size
+        while (self.protectedSize >
+               maxProtectedFraction * (self.protectedSize + self.probationSize)
+               and len(self.protected) > 0):
+            k, s = self.protected.popitem(False)
+            self.protectedSize -= s
+            self.probation[k] = s
+            self.probationSize += s
+
+    def remove(self, key):
+        if key in self.protected:
+            self.protectedSize -= self.protected.pop(key)
+        else:
+            self.probationSize -= self.probation.pop(key)
+
+    def evict(self):
+        if len(self.probation) > 0:
+            k, s = self.probation.popitem(False)
+            self.probationSize -= s
+        else:
+            k, s = self.protected.popitem(False)
+            self.protectedSize -= s
+        return (k, s)
+
+policies = [("LRU", LRU), ("Segmented LRU", SegmentedLRU)]
+
+trace = []
+budget = None
+for line in open(sys.argv[1]).readlines():
+    f = line.split()
+    if f[0] == "m":
+        if budget is None:
+            budget = int(f[1])
+    elif f[0] == "u":
+        trace.append((f[0], f[1], 0))
+    elif f[0] == "p":
+        trace.append((f[0], f[1], int(f[2])))
+
+budgets = [int(mb) * (1 << 20) for mb in sys.argv[2:]]
+if len(budgets) == 0:
+    budgets = [budget]
+
+def simulate(policyClass, budget):
+    policy = policyClass()
+    size = 0
+    evictable = {}
+    uses = {}
+    hits = 0
+    misses = 0
+    for (op, key, objSize) in trace:
+        if op == "u":
+            uses[key] = uses.get(key, 0) + 1
+            if key in evictable:
+                hits += 1
+                policy.remove(key)
+                size -= evictable.pop(key)
+            else:
+                misses += 1
+        else:
+            if key in evictable:
+                continue
+            evictable[key] = objSize
+            size += objSize
+            policy.add(key, objSize, uses.get(key, 0))
+            while size > budget:
+                k, s = policy.evict()
+                del evictable[k]
+                size -= s
+    return (hits, misses)
+
+for budget in budgets:
+    for (name, policyClass) in policies:
+        hits, misses = simulate(policyClass, budget)
+        total = max(1, hits + misses)
+        print("%d MB %s: %d hits, %d misses (%.1f%%)" %
+              (budget >> 20, name, hits, misses, 100.0 * hits / total))
@@ -0,0 +1,116 @@
+#!/usr/bin/python
+
+# Convert bundle index files to the version 2 index format (see
+# src/tileindex.h), which ZTopo uses without decompressing.
+#
+# Inputs may be raw .idx files, as written by buckets-level.py, or
+# compressed .idxz files, as written by compress.py. Each is converted to
+# <name>.idxz, replacing any compressed index of the same name.
+
+import struct
+import sys
+import zlib
+
+checkpointInterval = 16
+
+def treeSize(level):
+    return (4 ** (level + 1) - 1) // 3
+
+def readIndex(name):
+    data = open(name, "rb").read()
+    if data[:4] == b"ZTI2":
+        return None
+    if name.endswith(".idxz"):
+        # qCompress output: big-endian length, then a zlib stream
+        data = zlib.decompress(data[4:])
+    return struct.unpack("<%dI" % (len(data) // 4), data)
+
+def numLevels(idx):
+    n = 0
+    size = 0
+    while size < len(idx):
+        n += 1
+        size += treeSize(n)
+    if size != len(idx):
+        raise ValueError("index size %d is not a complete tree" % len(idx))
+    return n
+
+def varint(v):
+    out = bytearray()
+    while True:
+        c = v & 0x7f
+        v >>= 7
+        if v:
+            out.append(c | 0x80)
+        else:
+            out.append(c)
+            return bytes(out)
+
+def pad(data):
+    return data + b"\0" * (-len(data) % 4)
+
+def encode(idx):
+    levels = numLevels(idx)
+    headerSize = 8 + 24 * levels
+    body = b""
+    table = b""
+    base = 0
+    dataOffset = 0
+    for level in range(1, levels + 1):
+        nodes = treeSize(level)
+        leaves = 4 ** level
+        lengths = idx[base + nodes - leaves:base + nodes]
+
+        words = [0] * ((leaves + 31) // 32)
+        for j in range(leaves):
+            if lengths[j] > 0:
+                words[j // 32] |= 1 << (j % 32)
+        rank = []
+        count = 0
+        for w in words:
+            rank.append(count)
+            count += bin(w).count("1")
+
+        checkpoints = []
+        stream = b""
+        off = 0
+        t = 0
+        for j in range(leaves):
+            if lengths[j] == 0:
+                continue
+            if t % checkpointInterval == 0:
+                checkpoints += [off, len(stream)]
+            stream += varint(lengths[j])
+            off += lengths[j]
+            t += 1
+        if off != idx[base]:
+            raise ValueError("level %d lengths do not add up to its total" % level)
+
+        bitmapPos = headerSize + len(body)
+        body += struct.pack("<%dI" % len(words), *words)
+        rankPos = headerSize + len(body)
+        body += struct.pack("<%dI" % len(rank), *rank)
+        checkpointPos = headerSize + len(body)
+        body += struct.pack("<%dI" % len(checkpoints), *checkpoints)
+        lengthsPos = headerSize + len(body)
+        body = pad(body + stream)
+
+        table += struct.pack("<6I", dataOffset, count, bitmapPos, rankPos,
+                             checkpointPos, lengthsPos)
+        dataOffset += idx[base]
+        base += nodes
+    return b"ZTI2" + struct.pack("<I", levels) + table + body
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        print("Usage: indexv2 <index file> ...")
+        sys.exit(1)
+
+    for name in sys.argv[1:]:
+        idx = readIndex(name)
+        if idx is None:
+            continue
+        out = name[:name.rfind(".")] + ".idxz"
+        f = open(out, "wb")
+        f.write(encode(idx))
+        f.close()
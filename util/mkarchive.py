@@ -0,0 +1,81 @@
+#!/usr/bin/python
+
+# Pack a directory of map bundles (.idxz and .dat files, as written by
+# assemble.sh) into a single map archive (see src/localsource.h). ZTopo
+# reads the archive in place when the map's base URL is a file: URL naming
+# it, so a whole map can be copied and used offline as one file.
+
+import os
+import shutil
+import struct
+import sys
+
+version = 1
+headerSize = 32
+entrySize = 24
+
+def fnv1a(data):
+    h = 0xcbf29ce484222325
+    for c in bytearray(data):
+        h = ((h ^ c) * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+def align(pos):
+    return pos + (-pos % 8)
+
+# Names of the bundle files under root, relative to it and '/'-separated
+def bundleFiles(root):
+    names = []
+    for (dirpath, dirnames, filenames) in os.walk(root):
+        rel = os.path.relpath(dirpath, root)
+        for f in filenames:
+            if f.endswith(".idxz") or f.endswith(".dat"):
+                path = f if rel == "." else os.path.join(rel, f)
+                names.append(path.replace(os.sep, "/"))
+    return sorted(names)
+
+def writeArchive(root, out):
+    names = bundleFiles(root)
+
+    nameTable = b""
+    namePos = {}
+    for n in names:
+        namePos[n] = len(nameTable)
+        nameTable += n.encode("utf-8") + b"\0"
+
+    directoryPos = headerSize
+    namesPos = directoryPos + entrySize * len(names)
+    pos = align(namesPos + len(nameTable))
+    entries = []
+    for n in names:
+        size = os.path.getsize(os.path.join(root, n))
+        if size > 0xffffffff:
+            raise ValueError("%s is too large to archive" % n)
+        entries.append((fnv1a(n.encode("utf-8")), pos, size, namePos[n]))
+        pos = align(pos + size)
+    entries.sort()
+
+    f = open(out, "wb")
+    f.write(b"ZTMA" + struct.pack("<IIIQQ", version, len(names), len(nameTable),
+                                  directoryPos, namesPos))
+    for e in entries:
+        f.write(struct.pack("<QQII", *e))
+    f.write(nameTable)
+
+    # File data, in name order, so the bundles of a layer are kept together
+    for n in names:
+        f.write(b"\0" * (-f.tell() % 8))
+        src = open(os.path.join(root, n), "rb")
+        shutil.copyfileobj(src, f)
+        src.close()
+    size = f.tell()
+    f.close()
+    return (len(names), size)
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print("Usage: mkarchive <bundle directory> <archive>")
+        sys.exit(1)
+
+    (files, size) = writeArchive(sys.argv[1], sys.argv[2])
+    print("Wrote %d bundle files, %d bytes" % (files, size))
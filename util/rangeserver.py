@@ -0,0 +1,171 @@
+#!/usr/bin/python
+
+# Serve a directory of map bundles (.idxz and .dat files) over HTTP, with
+# support for Range requests, for testing and benchmarking the tile cache
+# (see src/netbench.cpp) without touching the real map server.
+#
+# Each request can be delayed, rate limited, or failed at random to mimic a
+# slow or unreliable network.
+
+import os
+import random
+import sys
+import threading
+import time
+from optparse import OptionParser
+
+try:
+    from http.server import BaseHTTPRequestHandler, HTTPServer
+    from socketserver import ThreadingMixIn
+except ImportError:
+    from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+    from SocketServer import ThreadingMixIn
+
+parser = OptionParser(usage="Usage: rangeserver [options] <directory>")
+parser.add_option("-p", "--port", type="int", default=8000,
+                  help="port to listen on (default 8000)")
+parser.add_option("-l", "--latency", type="float", default=0,
+                  help="delay before each reply, in ms")
+parser.add_option("-b", "--bandwidth", type="float", default=0,
+                  help="transfer rate of each reply, in KB/s (0 = unlimited)")
+parser.add_option("-e", "--error-rate", type="float", default=0,
+                  help="fraction of requests answered with 503")
+parser.add_option("-s", "--single-range", action="store_true", default=False,
+                  help="answer only the first range of a multiple range "
+                  "request, as some servers do")
+(options, args) = parser.parse_args()
+if len(args) != 1:
+    parser.print_help()
+    sys.exit(1)
+
+root = os.path.abspath(args[0])
+boundary = "ztopo-range-boundary"
+chunkSize = 16384
+
+statsLock = threading.Lock()
+stats = {"requests": 0, "ranges": 0, "bytes": 0, "errors": 0}
+
+def addStats(**kw):
+    statsLock.acquire()
+    for k, v in kw.items():
+        stats[k] += v
+    statsLock.release()
+
+# Parse a Range header into a list of (start, end) pairs, inclusive. Returns
+# None if the header is malformed, and an empty list if no range overlaps the
+# file.
+def parseRanges(header, size):
+    if not header.startswith("bytes="):
+        return None
+    ranges = []
+    for spec in header[len("bytes="):].split(","):
+        spec = spec.strip()
+        if "-" not in spec:
+            return None
+        first, last = spec.split("-", 1)
+        try:
+            if first == "":
+                start = max(0, size - int(last))
+                end = size - 1
+            else:
+                start = int(first)
+                end = size - 1 if last == "" else min(int(last), size - 1)
+        except ValueError:
+            return None
+        if start <= end:
+            ranges.append((start, end))
+    return ranges
+
+class RangeHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def write(self, data):
+        if options.bandwidth <= 0:
+            self.wfile.write(data)
+            return
+        rate = options.bandwidth * 1024.0
+        for i in range(0, len(data), chunkSize):
+            chunk = data[i:i + chunkSize]
+            self.wfile.write(chunk)
+            time.sleep(len(chunk) / rate)
+
+    def reply(self, status, headers, body):
+        if options.latency > 0:
+            time.sleep(options.latency / 1000.0)
+        self.send_response(status)
+        for (k, v) in headers:
+            self.send_header(k, v)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.write(body)
+        addStats(requests=1, bytes=len(body))
+
+    def do_HEAD(self):
+        self.do_GET()
+
+    def do_GET(self):
+        path = os.path.normpath(os.path.join(root, self.path.split("?")[0].lstrip("/")))
+        if not path.startswith(root + os.sep) or not os.path.isfile(path):
+            self.reply(404, [], b"")
+            return
+        if random.random() < options.error_rate:
+            addStats(errors=1)
+            self.reply(503, [], b"")
+            return
+
+        f = open(path, "rb")
+        data = f.read()
+        f.close()
+        size = len(data)
+
+        header = self.headers.get("Range")
+        if header is None:
+            addStats(ranges=1)
+            self.reply(200, [("Content-Type", "application/octet-stream")], data)
+            return
+
+        ranges = parseRanges(header, size)
+        if ranges is None:
+            self.reply(400, [], b"")
+            return
+        if len(ranges) == 0:
+            self.reply(416, [("Content-Range", "bytes */%d" % size)], b"")
+            return
+        if options.single_range:
+            ranges = ranges[:1]
+
+        addStats(ranges=len(ranges))
+        if len(ranges) == 1:
+            (start, end) = ranges[0]
+            self.reply(206, [("Content-Type", "application/octet-stream"),
+                             ("Content-Range", "bytes %d-%d/%d" % (start, end, size))],
+                       data[start:end + 1])
+            return
+
+        parts = []
+        for (start, end) in ranges:
+            parts.append(("--%s\r\nContent-Type: application/octet-stream\r\n"
+                          "Content-Range: bytes %d-%d/%d\r\n\r\n" %
+                          (boundary, start, end, size)).encode("ascii"))
+            parts.append(data[start:end + 1])
+            parts.append(b"\r\n")
+        parts.append(("--%s--\r\n" % boundary).encode("ascii"))
+        self.reply(206, [("Content-Type",
+                          "multipart/byteranges; boundary=" + boundary)],
+                   b"".join(parts))
+
+    def log_message(self, format, *args):
+        pass
+
+class ThreadedServer(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+server = ThreadedServer(("", options.port), RangeHandler)
+print("Serving %s on port %d" % (root, options.port))
+try:
+    server.serve_forever()
+except KeyboardInterrupt:
+    pass
+print("%d requests for %d ranges, %d bytes sent, %d errors injected" %
+      (stats["requests"], stats["ranges"], stats["bytes"], stats["errors"]))
@@ -15,29 +15,40 @@ INCLUDEPATH += "$$QJSON_ROOT/include" "$$BDB_ROOT/include"
 LIBS += -L "$$BDB_ROOT/lib" -l$$BDB_LIB
 LIBS += -L"$$QJSON_ROOT/lib" -lqjson
 LIBS += -L"$$PROJ4_LIBS" -lproj
+LIBS += -lpng
 
 
 # Input
-HEADERS += src/consts.h \
+HEADERS += src/areadownload.h \
+           src/byteranges.h \
+           src/consts.h \
            src/coordformatter.h \
+           src/localsource.h \
            src/mainwindow.h \
            src/map.h \
            src/maprenderer.h \
            src/mapwidget.h \
+           src/pixelkernels.h \
            src/preferences.h \
            src/printscene.h \
            src/printview.h \
            src/projection.h \
            src/rootdata.h \
            src/searchhandler.h \
-           src/tilecache.h
+           src/tilecache.h \
+           src/tiledecoder.h \
+           src/tileindex.h
 FORMS += src/preferences.ui
-SOURCES += src/coordformatter.cpp \
+SOURCES += src/areadownload.cpp \
+           src/byteranges.cpp \
+           src/coordformatter.cpp \
+           src/localsource.cpp \
            src/main.cpp \
            src/mainwindow.cpp \
            src/map.cpp \
            src/maprenderer.cpp \
            src/mapwidget.cpp \
+           src/pixelkernels.cpp \
            src/preferences.cpp \
            src/printscene.cpp \
            src/printview.cpp \
@@ -45,6 +56,8 @@ SOURCES += src/coordformatter.cpp \
            src/rootdata.cpp \
            src/searchhandler.cpp \
            src/tilecache.cpp \
+           src/tiledecoder.cpp \
+           src/tileindex.cpp \
 
 RESOURCES += src/resources.qrc
 QT += network opengl xml